@@ -3,709 +3,4974 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+// Default memory geometry, can be changed with command-line flags
 #define SIZE 64
+#define PAGE_SIZE 16
 #define MAX_PROC 4
 #define MAX_PAGES 4
+#define TLB_SIZE 16
+#define TLB_WAYS 4
+#define WS_WINDOW 16
+#define DISK_FILE "disk.bin"
+#define TRACE_MAGIC "P4TRACE2" // First 8 bytes of a binary trace file
+#define CHECKPOINT_MAGIC "P4CKPT04" // First 8 bytes of a checkpoint image
+
+// Log levels, each level also prints everything from the levels below it
+#define LOG_SILENT 0 // Nothing but startup errors
+#define LOG_SUMMARY 1 // Reports at exit
+#define LOG_EVENTS 2 // Every instruction and memory event
+#define LOG_DEBUG 3 // Replacement and TLB decisions
+#define LOG_BUFFER (1 << 20) // Bytes buffered before output is written
+
+// Prints a message if the log level is high enough, arguments are not evaluated otherwise
+#define LOG(level, ...) do { if (log_level >= (level)) printf(__VA_ARGS__); } while (0)
+
+// Records a memory event in the event stream and prints its message at the events level, fmt may be NULL
+#define LOG_EVENT(event, pid, v_page, frame, slot, ...) do { if (log_level >= LOG_EVENTS || event_log != NULL) log_event(event, pid, v_page, frame, slot, __VA_ARGS__); } while (0)
+#define DISK_SLOTS 64 // Initial swap slots, the swap file doubles in size when it fills up
+
+// Page table entries are fixed-width words stored in the page table frame, indexed by virtual page
+typedef unsigned int pte_t;
+#define PTE_SIZE ((int)sizeof(pte_t))
+#define PTE_VALID 0x01 // Virtual page has been mapped
+#define PTE_PRESENT 0x02 // Virtual page is in a physical frame
+#define PTE_WRITE 0x04 // Writes are allowed to the virtual page
+#define PTE_DIRTY 0x08 // Page has been written since it was brought into memory
+#define PTE_REF 0x10 // Page has been accessed
+#define PTE_HUGE 0x20 // Level 2 entry maps a large page of 1 << pt_bits physical pages instead of a level 1 table
+#define PTE_COW 0x40 // Page is shared after a fork, the first store copies it and makes it writable
+#define PTE_SHARED 0x80 // Page is a shared memory page, stores are seen by every process that maps it
+#define PTE_FLAGS 0xFF
+#define PTE_FRAME_SHIFT 8 // Physical frame number is stored above the flag bits
+
+// Memory geometry
+int mem_size = SIZE; // Bytes of physical memory
+int page_size = PAGE_SIZE; // Bytes per page, always a power of two
+int page_shift = 4; // log2(page_size)
+int num_frames = SIZE / PAGE_SIZE; // Physical pages
+int max_proc = MAX_PROC; // Processes
+long long max_pages = MAX_PAGES; // Virtual pages per process
+int pt_bits = 2; // log2 of the entries that fit in one page table
+int pt_levels = 1; // Levels of page tables, level 1 tables map data pages and the root table is level pt_levels
 
 // Memory
-unsigned char memory[SIZE];
+unsigned char *memory;
+char *swap_page; // Holds the page swap reads in while the page it replaces is written out, pages can be too large for the stack
+char *copy_page; // Holds a page being copied, so its frame can be evicted to make room for the copy
+char *block_page; // Holds a piece of a block copy while its destination is brought in
+
+// PID array
+int *pid_array;
+
+// Free list
+int *free_list;
+
+// Reverse map, the owner of each physical page, kept up to date whenever a page is given new contents
+typedef struct
+{
+    int pid; // -1 if the page has no owner
+    int level; // 0 for a data page, otherwise the level of the page table it holds
+    long long v_page; // Virtual page, or the first virtual page a page table maps
+} rmap_entry;
+
+rmap_entry *rmap;
+
+// Further processes mapping a data page after a fork, chained from the page's reverse map entry
+typedef struct
+{
+    int pid;
+    long long v_page;
+    int next; // Next sharer of the same physical page, -1 at the end of the chain
+} sharer_entry;
+
+sharer_entry *sharers; // Grows as needed, unused entries are chained from sharers_free
+int sharers_cap = 0;
+int sharers_free = -1;
+int *frame_sharers; // Per physical page, first sharer besides its reverse map entry, -1 if none
+int *frame_refs; // Per physical page, processes that map it
+
+// Shared memory, "share" maps a virtual page to a numbered shared page that any process can map
+// Each key remembers the first virtual page mapped to it, later mappers find its physical page or swap slot through that entry
+typedef struct
+{
+    int key;
+    int pid; // -1 if the hash table slot is empty
+    long long v_page;
+} shm_entry;
+
+shm_entry *shm_table; // Open addressing hash table of keys
+int shm_mask = -1; // Number of hash table slots - 1
+int shm_count = 0;
+
+// Fork counters
+int fork_count = 0;
+long long cow_faults = 0; // Stores to copy-on-write pages
+long long cow_copies = 0; // Of those, the ones that had to copy a shared page
+
+// Swap slot that still holds a copy of each physical page since it was swapped in, -1 if there is none
+int *frame_slot;
+
+// Swap slot of each process's root page table while it is on disk, other pages keep their swap slot in their parent's entry
+int *on_disk;
+
+// Page tables on the path of the running instruction, they are not evicted until it finishes
+// Each worker thread pins the tables of its own instruction, there are never more than one per level
+_Thread_local int pinned[64];
+_Thread_local int num_pinned = 0;
+unsigned char *frame_pinned; // Per physical page, 1 if it is in some thread's pinned
+
+// Large pages, a map with value 2 or 3 maps 1 << pt_bits virtual pages with one level 2 entry and one TLB entry
+// Their physical pages are contiguous and aligned, and they stay in memory like hugetlb pages
+unsigned char *frame_huge; // Per physical page, 1 if it is part of a large page
+int large_pages = 0; // Large pages mapped, the TLB only looks for large entries while there is one
+
+// Demand-zero mapping, -u maps new pages to the shared zero page and only gives them a physical page on their first store
+// Their entries are not present and hold ZERO_SLOT instead of a swap slot, loads from them find no value stored
+#define ZERO_SLOT ((int)(~(pte_t)0 >> PTE_FRAME_SHIFT))
+#define ZERO_ADDR -2 // Physical address access_page returns for a load from the zero page
+int demand_zero = 0;
+long long zero_maps = 0; // Pages mapped to the zero page
+long long zero_reads = 0; // Loads served by the zero page
+long long zero_fills = 0; // Pages given a physical page by their first store
+
+// Unmap counters, a physical page or swap slot is only freed once no process maps it any more
+long long unmapped_pages = 0;
+long long freed_frames = 0;
+long long freed_slots = 0;
+
+// Disk, a swap file of fixed-size slots mapped into memory, slot n starts at n * page_size
+int disk_fd = -1;
+unsigned char *disk_map;
+int disk_slots = 0;
+
+// Bitmap of used swap slots
+uint64_t *disk_used;
+int disk_hint = 0; // Every slot below this one is used
+
+// Per swap slot, virtual pages whose contents it holds, a page whose slot is shared with a forked process gets a new slot once written
+int *slot_refs;
+int *slot_frame; // Per swap slot, physical page it was last swapped into, so processes sharing the slot can share that page too
+
+// Write-back queue, -q hands evicted pages to a writer thread that writes them into the swap file with pwrite
+// Pages waiting in the queue are read back from it, and a page written twice before the writer gets to it is only written once
+typedef struct
+{
+    int slot;
+    unsigned char *data; // page_size bytes
+} wb_entry;
+
+wb_entry *wb_queue; // Ring buffer of wb_depth entries
+unsigned char *wb_buffer; // The page the writer is writing, after the queue's pages
+int wb_depth = 0; // 0 writes straight into the mapped swap file
+int wb_head = 0; // Oldest entry
+int wb_count = 0;
+int wb_inflight = -1; // Slot the writer is writing right now
+int wb_stop = 0; // Set when the writer should exit once the queue is empty
+long long wb_written = 0;
+long long wb_merged = 0; // Pages written again while an older copy was still queued
+long long wb_stalls = 0; // Evictions that waited for room in a full queue
+pthread_t wb_thread;
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER; // Signalled whenever an entry is added or written
+
+// Compressed swap pool, -z keeps data pages evicted to swap compressed in memory up to this many bytes
+// Pages in the pool keep their swap slot, the least recently used ones are written to the swap file when the pool is full
+typedef struct
+{
+    unsigned char *data; // Compressed page, NULL if the slot is not in the pool
+    int len;
+    int older; // Less recently used slot in the pool, -1 for the oldest
+    int newer;
+} zswap_entry;
+
+#define ZSWAP_HASH_BITS 10 // Hash table of 3-byte sequences used to find matches while compressing
+
+zswap_entry *zswap; // Per swap slot
+unsigned char *zswap_buffer; // A page being compressed, until its size is known
+char *zswap_page; // A page being spilled to the swap file, which can happen in the middle of a compression
+long long zswap_limit = 0; // 0 sends every eviction to the swap file
+long long zswap_used = 0; // Compressed bytes in the pool
+int zswap_oldest = -1;
+int zswap_newest = -1;
+long long zswap_stored = 0; // Pages compressed into the pool
+long long zswap_bytes = 0; // Compressed size of those pages
+long long zswap_rejected = 0; // Pages that did not compress and went to the swap file
+long long zswap_loads = 0; // Swap-ins served from the pool
+long long zswap_spilled = 0; // Pages written from the pool to the swap file
+long long disk_writes = 0; // Pages written to the swap file
+long long disk_reads = 0; // Pages read from the swap file
+
+// Prefetcher state per process, misses that keep the same virtual page stride pull the next pages in ahead of demand
+typedef struct
+{
+    long long last_page; // Last virtual page that missed or used a prefetched page, -1 if none
+    long long stride; // Virtual pages between the last two of those
+    long long faults; // Data pages that had to be swapped in on demand
+    long long prefetches; // Pages swapped in ahead of demand
+    long long used; // Prefetched pages that were accessed before being evicted
+} prefetch_state;
+
+prefetch_state *prefetch;
+int prefetch_window = 0; // Pages prefetched past a miss, 0 disables the prefetcher
+unsigned char *frame_prefetched; // Per physical page, 1 if it was prefetched and has not been accessed yet
+
+// Free frame pool, -f evicts pages after an instruction until this many physical pages are free, so faults find one ready
+int free_target = 0;
+int free_frames = 0; // Physical pages on the free list
+
+// Latency model, every instruction costs simulated time: an access its TLB lookup, a TLB miss a table walk per level,
+// every fault its handling, and every read or write of the swap file the time the single simulated disk takes for it
+// I/O queues on the disk behind the I/O issued before it, writes through the write-back queue only wait once it is full, prefetches and free pool refills never do
+#define LAT_SUB_BITS 5 // Histogram buckets per power of two are 1 << LAT_SUB_BITS, so percentiles are within about 3%
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS) << LAT_SUB_BITS)
+
+typedef struct
+{
+    long long time; // Simulated time of all the process's instructions
+    long long accesses; // Loads, stores and the pieces of copies and fills
+    long long access_time; // Sum of the accesses' latencies
+    long long hist[LAT_BUCKETS]; // Accesses per latency bucket
+} lat_state;
+
+int latency_model = 0; // 1 prints the latency report, the costs are counted either way
+long long lat_tlb = 10; // Nanoseconds for an access that hits the TLB
+long long lat_walk = 100; // Per level of page tables walked on a TLB miss
+long long lat_fault = 1000; // Handling a minor or major fault, before its disk I/O
+long long lat_swap_in = 100000; // Reading a page from the swap file
+long long lat_swap_out = 100000; // Writing a page to the swap file
+lat_state *lat;
+long long sim_time = 0; // Simulated nanoseconds of all instructions so far
+long long disk_free_at = 0; // Simulated time at which the disk finishes the I/O queued on it
+long long disk_wait = 0; // Time instructions spent waiting for the disk behind other I/O
+_Thread_local long long lat_cost = 0; // Cost of the running instruction so far
+_Thread_local int lat_async = 0; // Set while I/O is issued ahead of demand, so nothing waits for it
+
+// Resident sets, the data pages each process has in memory, -s caps them so that a process at its cap evicts its own pages
+// -i samples and clears the referenced bits every that many instructions, the pages referenced in between are the process's working set
+typedef struct
+{
+    int pages; // Data pages in memory that the process maps, a shared page counts for every process mapping it
+    int peak;
+    long long cap_evictions; // Own pages evicted to stay within the cap
+    int ws_last; // Pages referenced in the last sample window
+    int ws_peak;
+    long long ws_total; // Sum over all samples, for the average
+} rss_state;
+
+rss_state *rss;
+int rss_cap = 0; // 0 lets a process use any physical page
+int ws_interval = 0; // 0 disables the working set estimator
+long long ws_next = 0; // Instruction count at which the next sample is due
+long long ws_last_inst = 0; // Instruction count of the last sample
+long long ws_samples = 0;
+_Thread_local int evict_local = 0; // Set while the replacement policy may only choose the faulting process's own data pages
+
+// Logging
+int log_level = LOG_EVENTS;
+FILE *event_log = NULL; // Event stream, one JSON object per line
+long long inst_count = 0; // Instructions run so far
+
+// Worker threads, -j runs the processes of a trace on this many threads against the same physical memory
+// Locks are taken in the order vm_lock, then proc_lock, tlb_lock and log_lock are only held briefly and never while waiting for another lock
+// Faults are serialized by vm_lock, the locks of other processes are only polled for under it with lock_process
+int num_threads = 0; // 0 runs every instruction on the main thread
+pthread_mutex_t vm_lock = PTHREAD_MUTEX_INITIALIZER; // Held by any instruction that can fault, covers frame allocation, eviction and the swap file
+pthread_mutex_t *proc_lock; // Per process, held while its page tables and pages are used or changed
+_Thread_local int held_pid = -1; // Process whose lock this worker thread holds for the running instruction
+pthread_mutex_t tlb_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER; // Keeps event stream lines whole
+
+// Counters kept per process and per physical frame
+typedef struct
+{
+    long long accesses; // Loads and stores that reached memory
+    long long hits; // Accesses to pages that were already in memory
+    long long minor_faults; // Pages and page tables given a new frame without disk I/O
+    long long major_faults; // Pages and page tables read back from disk
+    long long swap_ins;
+    long long swap_outs; // Pages written to disk
+    long long clean_evictions; // Evicted pages whose disk copy was up to date, so nothing was written
+    long long ptable_evictions; // Times a page table was evicted
+    long long wp_faults; // Stores to read-only pages
+    long long bytes_to_disk;
+    long long bytes_from_disk;
+} vm_stats;
+
+vm_stats *pid_stats;
+vm_stats *frame_stats;
+
+// Round Robin Eviction
+int last_evict = 0;
+
+// Page replacement policy, chooses the physical page evict() returns
+typedef struct
+{
+    char *name;
+    int (*choose)(int pid); // Returns physical page to evict, never pid's own page table
+} policy;
+
+int evict_rr(int pid);
+int evict_fifo(int pid);
+int evict_lru(int pid);
+int evict_lfu(int pid);
+int evict_clock(int pid);
+int evict_second(int pid);
+int evict_ws(int pid);
+int evict_opt(int pid);
+
+policy policies[] = {
+    {"rr", evict_rr}, // Round robin over physical pages
+    {"fifo", evict_fifo}, // Oldest page brought into memory
+    {"lru", evict_lru}, // Least recently used
+    {"lfu", evict_lfu}, // Least frequently used
+    {"clock", evict_clock}, // Clock sweep over referenced bits
+    {"second", evict_second}, // FIFO that gives referenced pages a second chance
+    {"ws", evict_ws}, // Oldest page outside the working set window, LRU if every page is inside it
+    {"opt", evict_opt}, // Belady's optimal, page whose next use is furthest away in the trace
+};
+policy *cur_policy = &policies[0];
+
+// Replacement policy state per physical page
+// Worker threads update it without vm_lock, so a policy may see a slightly stale view of other processes' accesses
+unsigned int access_clock = 0; // Counts page accesses
+unsigned int *frame_loaded; // access_clock when the page was brought into memory
+unsigned int *frame_last_use; // access_clock of the last access
+unsigned int *frame_uses; // Accesses since the page was brought into memory
+unsigned char *frame_ref; // Referenced since the clock hand last passed
+int clock_hand = 0;
+unsigned int ws_window = WS_WINDOW; // Accesses that make up the working set
+
+// Binary trace record, a binary trace file is TRACE_MAGIC followed by an array of these in host byte order
+typedef struct
+{
+    uint16_t pid;
+    uint8_t op; // Instruction type, 1 = map, 2 = store, 3 = load, 4 = stats, 5 = fork, 6 = share, 7 = copy, 8 = fill, 9 = unmap, 10 = protect
+    uint8_t width; // Bytes loaded or stored, 1, 2, 4 or 8
+    int32_t len; // Bytes copied or filled
+    int64_t value; // Value stored, or the source address of a copy
+    uint64_t v_addr;
+} trace_record;
+
+// Trace read ahead of time for OPT, or replayed from a binary trace file
+trace_record *trace;
+char **trace_lines; // Text of each line when the trace came from stdin
+int trace_len = 0;
+int trace_pos = 0; // Next line to run
+char *replay_file = NULL; // Binary trace to replay instead of reading stdin
+char *convert_file = NULL; // Binary trace to write from the text instructions on stdin
+int *opt_next_use; // Per trace line, next line that touches the same virtual page
+int *opt_next_pid; // Per trace line, next line of the same process
+long long *opt_keys; // Open addressing hash table of virtual pages (pid * max_pages + v_page) in the trace, -1 if empty
+int *opt_pending; // Per slot of opt_keys, next line that touches the virtual page
+int opt_mask = 0; // Number of hash table slots - 1
+int *opt_pending_pt; // Per process, next line that touches its page table
+double run_seconds = -1; // Wall time of the last trace run, -1 if no trace was run
+
+// Synthetic workloads that can be generated in place of a trace
+// uniform: random pages, zipf: Zipf distributed pages, scan: every word of every page in order,
+// loop: pages in order over a loop 25% larger than the process's share of memory,
+// phase: random pages of a small working set that moves every eighth of the trace, mix: process N runs workload N % 5
+char *workloads[] = {"uniform", "zipf", "scan", "loop", "phase", "mix"};
+int gen_workload = -1; // Index into workloads, -1 if the trace is not generated
+long long gen_len = 100000; // Loads and stores to generate
+unsigned long long gen_state = 1; // Random number generator state, set by the seed
+
+// Checkpoint image, CHECKPOINT_MAGIC and this header followed by the sections of ckpt_sections, the used swap slots and the swap pool
+// Images hold raw structs, so they can only be restored by the same build of the program
+typedef struct
+{
+    char magic[8];
+    int mem_size;
+    int page_size;
+    int max_proc;
+    long long max_pages;
+    int tlb_size;
+    int tlb_ways;
+    int disk_slots;
+    int disk_hint;
+    int sharers_cap;
+    int sharers_free;
+    int shm_mask;
+    int shm_count;
+    int fork_count;
+    int large_pages;
+    int free_frames;
+    int last_evict;
+    int clock_hand;
+    unsigned int access_clock;
+    unsigned int tlb_clock;
+    int ws_interval; // Of the run that wrote the image, ws_next is only kept if the restoring run samples as often
+    long long ws_next;
+    long long ws_last_inst;
+    long long ws_samples;
+    long long inst_count;
+    long long cow_faults;
+    long long cow_copies;
+    long long zero_maps;
+    long long zero_reads;
+    long long zero_fills;
+    long long unmapped_pages;
+    long long freed_frames;
+    long long freed_slots;
+    long long zswap_pages; // Compressed pages in the swap pool
+    long long zswap_stored;
+    long long zswap_bytes;
+    long long zswap_rejected;
+    long long zswap_loads;
+    long long zswap_spilled;
+    long long disk_writes;
+    long long disk_reads;
+    long long wb_written;
+    long long wb_merged;
+    long long wb_stalls;
+    long long sim_time;
+    long long disk_free_at;
+    long long disk_wait;
+} checkpoint_header;
+
+// One array of the machine state in a checkpoint image
+typedef struct
+{
+    void *data;
+    size_t len;
+} ckpt_section;
+
+char *checkpoint_file = NULL; // Image to write when the run ends
+char *restore_file = NULL; // Image to start from instead of an empty machine
+
+// TLB entry, translations are tagged with the owning PID so entries from every process share one TLB
+typedef struct
+{
+    int pid; // -1 if the entry is empty
+    long long v_page;
+    int p_page;
+    pte_t flags; // PTE flags at the time the translation was cached
+    unsigned int last_use; // For LRU replacement within a set
+} tlb_entry;
+
+// TLB, split into tlb_size / tlb_ways sets of tlb_ways entries
+tlb_entry *tlb;
+int tlb_size = TLB_SIZE; // 0 disables the TLB
+int tlb_ways = TLB_WAYS;
+int tlb_sets = TLB_SIZE / TLB_WAYS;
+unsigned int tlb_clock = 0; // Lookup counter used as LRU timestamp
+
+// TLB hits and misses per PID
+long long *tlb_hits;
+long long *tlb_misses;
+
+// Function Declarations
+int parse_args(int argc, char *argv[]); // Reads geometry flags, returns index of the first instruction argument
+int init_memory(); // Allocates memory and bookkeeping for the configured geometry
+int log_open(char *path); // Opens the event stream
+void log_event(const char *event, int pid, long long v_page, int frame, int slot, const char *fmt, ...); // Records a memory event
+void log_close(); // Flushes all buffered output
+long long find_page(long long addr); // Returns a corresponding page based on an address
+int find_address(int page); // Returns address of the start of a given page
+void write_value(int start, long long value, int width); // Writes a value of 1, 2, 4 or 8 bytes into physical memory
+long long read_value(int start, int width); // Reads a value of 1, 2, 4 or 8 bytes from physical memory
+pte_t get_pte(unsigned char *entry); // Reads a page table entry in memory or on disk
+void set_pte(unsigned char *entry, pte_t pte); // Writes a page table entry in memory or on disk
+int pt_index(long long v_page, int level); // Returns index of a virtual page's entry in its page table at a level
+unsigned char *find_pte(int pid, long long v_page, int level); // Finds a page table entry without bringing tables into memory
+void pin_frame(int page); // Keeps a page table in memory until the instruction finishes
+int pte_frame(pte_t pte, long long v_page); // Returns the physical page an entry maps a virtual page to
+void unpin_frames(); // Lets the page tables of the last instruction be evicted again
+int walk(int pid, long long v_page, int create); // Brings page tables into memory, returns physical address of the page's entry
+int walk_level(int pid, long long v_page, int create, int stop); // Brings page tables into memory down to a level, returns physical address of the page's entry there
+int translate_ptable(int pid, long long v_addr); // Translate page table, return physical address from virtual address
+int tlb_lookup(int pid, long long v_page, pte_t need); // Returns cached physical page with the needed flags, -1 on a miss
+tlb_entry *tlb_set(int pid, long long tag); // Returns the TLB set a translation tag maps to
+void tlb_insert(int pid, long long v_page, pte_t pte); // Caches the translation in a page table entry
+void tlb_invalidate(int pid, long long v_page); // Drops the cached translation of a virtual page
+void tlb_invalidate_range(int pid, long long first, long long count); // Drops the cached translations of a range of virtual pages in one pass
+void tlb_report(); // Prints TLB hit rate per process
+void count_fault(int pid, int major); // Counts a fault of a process and charges its handling time
+void lat_disk(long long cost, long long slack); // Queues an I/O on the simulated disk, charging the running instruction for waiting on it
+int lat_bucket(long long ns); // Returns the latency histogram bucket of a number of nanoseconds
+long long lat_percentile(long long *hist, long long count, double share); // Returns the latency a share of a histogram's accesses stay within
+void latency_report(); // Prints effective access time, stall time and latency percentiles per process
+void stats_add(vm_stats *total, vm_stats *add); // Adds one set of counters to another
+void stats_report(); // Prints counters per process, per physical frame and in total
+void prefetch_access(int pid, long long v_page, int pte_addr, int fault); // Feeds a miss or a prefetched page's first use to the prefetcher
+void prefetch_report(); // Prints prefetch accuracy and coverage per process
+int create_ptable(int pid); // Allocates page table entry into virtual page
+int load_ptable(int pid); // Makes sure a process's page table is in physical memory
+int map(int pid, long long v_addr, int r_value, int len); // Maps virtual page, or range of virtual pages, to physical pages
+int map_large(int pid, long long v_addr, pte_t rw_bit); // Maps the large page holding a virtual address
+int claim_large(int pid, long long v_page); // Returns the first of a run of physical pages for a large page, evicting what is in them
+int access_page(int pid, long long v_addr, int width, int write); // Translates a virtual address for a load or store, faulting the page in if needed
+int access_fits(long long v_addr, int width, int write); // Returns 1 if an access stays within its page
+int timed_access(int pid, long long v_addr, int width, int write); // Runs access_page as one access of the latency model
+int store(int pid, long long v_addr, long long value, int width); // Stores value in physical memory
+int load(int pid, long long v_addr, int width); // Loads value from physical memory
+int block_copy(int pid, long long dst, long long src, int len); // Copies a range of virtual addresses, like memmove
+int block_fill(int pid, long long v_addr, int byte, int len); // Sets a range of virtual addresses to one byte, like memset
+int evict(int pid); // Returns physical page that is to be evicted
+int can_evict(int pid, int page); // Returns 1 if pid may evict the physical page
+void share_add(int page, int pid, long long v_page); // Adds a process to the mappers of a data page
+void share_remove(int page, int pid, long long v_page); // Removes a process from the mappers of a data page
+void share_clear(int page); // Leaves a physical page with a single owner
+void rss_add(int pid, int pages); // Counts data pages coming into or leaving a process's resident set
+int frame_mapped_by(int page, int pid); // Returns 1 if a process maps a physical data page
+int evict_own(int pid); // Returns one of a process's own data pages chosen by the replacement policy, -1 if none can be evicted
+int ws_due(); // Returns 1 if a working set sample is due
+void ws_sample(); // Counts and clears the referenced bits of every process
+int ws_scan(int pid, int level, long long base); // Counts and clears the referenced bits under one page table
+void rss_report(); // Prints resident set and working set sizes per process
+int fork_process(int pid, int child); // Clones a process's address space into an empty process, sharing its pages copy-on-write
+void fork_table(int pid, int child, int level, long long base); // Clones the entries of one of a process's page tables
+void fork_page(int pid, int child, long long v_page); // Shares one data page with a forked process
+int cow_break(int pid, long long v_page, int pte_addr); // Gives a process its own writable copy of a copy-on-write page, -1 if there is no physical page for it
+int page_shared(pte_t pte); // Returns 1 if another process also maps the page or swap slot of a data page entry
+int pte_zero(pte_t pte); // Returns 1 if a data page entry maps the zero page
+int map_shared(int pid, long long v_addr, int key); // Maps a virtual page to a shared memory page
+int shm_find(int key); // Returns slot of a shared memory key in its hash table
+void shm_add(int key, int pid, long long v_page); // Records the first virtual page mapped to a shared memory key
+void shm_release(int pid, long long v_page, pte_t pte); // Moves or forgets the shared memory key a page being unmapped is recorded under
+int shm_search(int pid, int level, long long base, pte_t pte, int *found_pid, long long *found_vpage); // Finds another mapping of a shared page under one page table
+long long range_last(long long v_addr, int len); // Returns the last virtual page of a range instruction, -1 if it goes past the address space
+int unmap_range(int pid, long long v_addr, int len); // Unmaps a range of virtual pages, freeing what no other process maps
+void unmap_page(int pid, long long v_page, unsigned char *entry); // Clears one data page entry and releases its physical page or swap slot
+void unmap_large(int pid, long long v_page, unsigned char *entry); // Clears a large page entry and frees its physical pages
+int protect_range(int pid, long long v_addr, int r_value, int len); // Changes permissions of a range of mapped virtual pages
+void policy_load(int page); // Resets replacement state of a physical page given new contents
+void policy_touch(int page); // Records an access to a physical page
+int parse_op(char *name, int *width); // Returns instruction type of an instruction name, 0 if unknown
+int parse_record(char *line, trace_record *record); // Parses a text instruction line into a trace record
+int read_text_trace(); // Reads all of stdin ahead of time
+int opt_slot(int pid, long long v_page, int add); // Returns slot of a virtual page in OPT's hash table
+int opt_prepare(); // Finds the next use of every page in the trace for OPT
+void opt_advance(int pos); // Moves OPT's view of the future past a trace record
+char *read_instruction(char *buffer, int size); // Reads the next instruction line, NULL at the end
+int run_instruction(int pid, int inst_type, long long v_addr, long long input, int width, int len); // Checks and runs one instruction
+int is_resident(int pid, long long v_addr); // Returns 1 if a load or store can run without faulting
+void lock_process(int pid); // Takes another process's lock while holding vm_lock
+void run_threaded(int pid, int inst_type, long long v_addr, long long input, int width, int len); // Runs one instruction from a worker thread
+void *worker_main(void *arg); // Runs the trace records of the processes assigned to one worker thread
+int run_threads(); // Runs the trace on the worker threads
+int replay_trace(char *path); // Runs every instruction of a binary trace file
+int convert_trace(char *path); // Writes the text instructions on stdin, or a generated trace, as a binary trace file
+int run_trace(); // Runs the trace records in memory, timing the run
+unsigned long long gen_random(); // Returns the next number of the workload generator
+int gen_trace(); // Generates the trace of a synthetic workload
+int ckpt_sections(ckpt_section *sections); // Lists the arrays saved in a checkpoint image, returns how many there are
+int checkpoint_save(char *path); // Writes the whole machine state to a checkpoint image
+int checkpoint_geometry(char *path); // Takes the memory geometry from a checkpoint image
+int checkpoint_restore(char *path); // Loads the machine state from a checkpoint image
+int find_owner(int page, int *r_pid, int *r_level, long long *r_vpage); // Finds process, table level and virtual page that a physical page belongs to
+int claim_frame(int pid, int level, long long v_page, int lineNum); // Returns a physical page holding a disk slot for a new owner, evicting if needed, -1 if it cannot
+int evict_page(int pid, int page, int lineNum); // Evicts a physical page, chosen by the replacement policy if page is -1, returns -1 if none can be
+void refill_free_pool(int pid); // Evicts pages ahead of demand until the free pool is full
+int remap(int pid, long long v_page, int p_page); //Remaps virtual page if pulled from disk
+int replace_page(int pid, long long v_page); // Handles page replacements
+int swap(int page, int lineNum, int slot, int dirty); // Swaps page from physical memory and disk, returns lineNum page was put in disk
+int disk_init(); // Creates an empty swap file and maps it into memory
+int disk_grow(); // Doubles the number of swap slots
+int disk_alloc(); // Reserves the lowest free swap slot
+void disk_write(int slot, char *page); // Writes page into a swap slot, through the write-back queue if there is one
+int wb_start(); // Starts the write-back queue and its writer thread
+void *wb_main(void *arg); // Writer thread, drains the write-back queue
+int wb_read(int slot, char *pageHolder); // Reads a page that is still in the write-back queue
+void wb_wait(int slot); // Waits until no write to a slot is pending
+void wb_close(); // Writes out the write-back queue and stops the writer thread
+int zs_compress(unsigned char *src, unsigned char *dst); // Compresses a page, returns its compressed size
+void zs_decompress(unsigned char *src, int len, unsigned char *dst); // Restores a compressed page
+int zswap_store(int slot, char *page); // Compresses a page into the swap pool as the copy of a swap slot
+int zswap_load(int slot, char *pageHolder); // Reads a swap slot's page from the swap pool
+void zswap_drop(int slot); // Removes a swap slot's page from the swap pool
+void zswap_spill(); // Writes the least recently used page in the swap pool to the swap file
+void zswap_report(); // Prints how much swap file traffic the swap pool saved
+int peekFromDisk(char *pageHolder, int lineNum); // Reads page from disk without freeing its line
+void slot_release(int slot); // Drops one mapping's reference to a swap slot, freeing the slot after the last one
+void disk_free(int slot); // Returns a swap slot to the free slots
+
+void logMem(); // DEBUGGING ONLY; DISPLAYS PHYSICAL MEMORY
+void logMem()
+{
+    for(int i = 0; i < mem_size; i++)
+    {
+        printf("INDEX %d IN MEMORY IS: [%c]\n", i, memory[i]);
+    }
+}
+
+// Reads geometry flags, returns index of the first instruction argument
+int parse_args(int argc, char *argv[])
+{
+    int i = 1;
+    while (i + 1 < argc && argv[i][0] == '-' && isalpha(argv[i][1]))
+    {
+        int value = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "-m") == 0)
+        {
+            mem_size = value;
+        }
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            page_size = value;
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            max_proc = value;
+        }
+        else if (strcmp(argv[i], "-v") == 0)
+        {
+            max_pages = atoll(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            tlb_size = value;
+        }
+        else if (strcmp(argv[i], "-a") == 0)
+        {
+            tlb_ways = value;
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            cur_policy = NULL;
+            for (int j = 0; j < (int)(sizeof(policies) / sizeof(policies[0])); j++)
+            {
+                if (strcmp(argv[i + 1], policies[j].name) == 0)
+                {
+                    cur_policy = &policies[j];
+                }
+            }
+            if (cur_policy == NULL)
+            {
+                printf("ERROR: Unknown replacement policy %s\n", argv[i + 1]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "-w") == 0)
+        {
+            ws_window = value;
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            replay_file = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-c") == 0)
+        {
+            convert_file = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            char *levels[] = {"silent", "summary", "events", "debug"};
+            log_level = isdigit(argv[i + 1][0]) ? value : -1;
+            for (int j = 0; j < 4; j++)
+            {
+                if (strcmp(argv[i + 1], levels[j]) == 0)
+                {
+                    log_level = j;
+                }
+            }
+            if (log_level < LOG_SILENT || log_level > LOG_DEBUG)
+            {
+                printf("ERROR: Unknown log level %s\n", argv[i + 1]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            wb_depth = value;
+        }
+        else if (strcmp(argv[i], "-z") == 0)
+        {
+            zswap_limit = atoll(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            prefetch_window = value;
+        }
+        else if (strcmp(argv[i], "-f") == 0)
+        {
+            free_target = value;
+        }
+        else if (strcmp(argv[i], "-j") == 0)
+        {
+            num_threads = value;
+        }
+        else if (strcmp(argv[i], "-u") == 0)
+        {
+            demand_zero = value;
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            rss_cap = value;
+        }
+        else if (strcmp(argv[i], "-i") == 0)
+        {
+            ws_interval = value;
+            ws_next = value;
+        }
+        else if (strcmp(argv[i], "-g") == 0)
+        {
+            for (int j = 0; j < (int)(sizeof(workloads) / sizeof(workloads[0])); j++)
+            {
+                if (strcmp(argv[i + 1], workloads[j]) == 0)
+                {
+                    gen_workload = j;
+                }
+            }
+            if (gen_workload == -1)
+            {
+                printf("ERROR: Unknown workload %s\n", argv[i + 1]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            gen_len = atoll(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-x") == 0)
+        {
+            gen_state = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            checkpoint_file = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-y") == 0)
+        {
+            restore_file = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-h") == 0)
+        {
+            latency_model = 1; // Costs missing from the list keep their defaults
+            sscanf(argv[i + 1], "%lld,%lld,%lld,%lld,%lld", &lat_tlb, &lat_walk, &lat_fault, &lat_swap_in, &lat_swap_out);
+        }
+        else if (strcmp(argv[i], "-e") == 0)
+        {
+            if (log_open(argv[i + 1]) == -1)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            printf("ERROR: Unknown flag %s\n", argv[i]);
+            return -1;
+        }
+        i += 2;
+    }
+
+    // A restored machine keeps the geometry it was saved with
+    if (restore_file != NULL && checkpoint_geometry(restore_file) == -1)
+    {
+        return -1;
+    }
+
+    if (page_size < 2 * PTE_SIZE || (page_size & (page_size - 1)) != 0)
+    {
+        printf("ERROR: Page size %d must be a power of two of at least %d bytes\n", page_size, 2 * PTE_SIZE);
+        return -1;
+    }
+    if (mem_size < 2 * page_size || mem_size % page_size != 0)
+    {
+        printf("ERROR: Memory size %d must be a multiple of the page size and hold at least 2 pages\n", mem_size);
+        return -1;
+    }
+    if (max_proc < 1 || max_pages < 1)
+    {
+        printf("ERROR: There must be at least 1 process and 1 virtual page\n");
+        return -1;
+    }
+    if (max_pages > ((long long)1 << 62) / page_size)
+    {
+        printf("ERROR: %lld virtual pages of %d bytes do not fit in a 63-bit address space\n", max_pages, page_size);
+        return -1;
+    }
+    if (mem_size / page_size > (1 << (32 - PTE_FRAME_SHIFT)))
+    {
+        printf("ERROR: A page table entry can only address %d physical pages\n", 1 << (32 - PTE_FRAME_SHIFT));
+        return -1;
+    }
+
+    if (tlb_size < 0 || (tlb_size > 0 && (tlb_ways < 1 || tlb_size % tlb_ways != 0)))
+    {
+        printf("ERROR: TLB size %d must be a multiple of its associativity %d\n", tlb_size, tlb_ways);
+        return -1;
+    }
+
+    if (lat_tlb < 0 || lat_walk < 0 || lat_fault < 0 || lat_swap_in < 0 || lat_swap_out < 0)
+    {
+        printf("ERROR: Latencies cannot be negative\n");
+        return -1;
+    }
+
+    if (num_threads < 0 || (num_threads > 0 && cur_policy->choose == evict_opt))
+    {
+        printf("ERROR: %d worker threads cannot be used with replacement policy %s\n", num_threads, cur_policy->name);
+        return -1;
+    }
+
+    page_shift = 0;
+    while ((1 << page_shift) < page_size)
+    {
+        page_shift++;
+    }
+    num_frames = mem_size / page_size;
+
+    // Each level of page tables resolves pt_bits bits of the virtual page number
+    pt_bits = 0;
+    while ((1 << pt_bits) < page_size / PTE_SIZE)
+    {
+        pt_bits++;
+    }
+    pt_levels = 1;
+    while (pt_bits * pt_levels < 62 && ((long long)1 << (pt_bits * pt_levels)) < max_pages)
+    {
+        pt_levels++;
+    }
+    // A copy walks to its source and its destination, each with a page at the end
+    if (num_frames < 2 * pt_levels + 2)
+    {
+        printf("ERROR: Memory must hold at least %d pages for %d levels of page tables\n", 2 * pt_levels + 2, pt_levels);
+        return -1;
+    }
+    int prefetch_max = num_frames - pt_levels - 2; // Frames left besides the tables and the page being accessed
+    if (prefetch_window < 0 || prefetch_window > prefetch_max)
+    {
+        printf("ERROR: The prefetch window must be 0 to %d pages\n", prefetch_max);
+        return -1;
+    }
+    if (zswap_limit < 0)
+    {
+        printf("ERROR: The swap pool size must be 0 or more bytes\n");
+        return -1;
+    }
+    if (rss_cap < 0 || ws_interval < 0 || ws_window > INT_MAX)
+    {
+        printf("ERROR: The resident set cap, the working set interval and the working set window must be 0 or more\n");
+        return -1;
+    }
+    if (wb_depth < 0 || free_target < 0 || free_target > num_frames - pt_levels - 1)
+    {
+        printf("ERROR: The write-back queue needs 0 or more pages and the free pool 0 to %d pages\n", num_frames - pt_levels - 1);
+        return -1;
+    }
+
+    tlb_sets = tlb_size > 0 ? tlb_size / tlb_ways : 0;
+
+    return i;
+}
+
+// Opens the event stream, events are written through a large buffer
+int log_open(char *path)
+{
+    event_log = fopen(path, "w");
+    if (event_log == NULL)
+    {
+        printf("ERROR: Cannot open event log %s\n", path);
+        return -1;
+    }
+    setvbuf(event_log, NULL, _IOFBF, LOG_BUFFER);
+    return 0;
+}
+
+// Records a memory event as a JSON line in the event stream and prints its message at the events level
+// Fields that are -1 are left out of the JSON object, a NULL fmt only writes the event stream
+void log_event(const char *event, int pid, long long v_page, int frame, int slot, const char *fmt, ...)
+{
+    if (event_log != NULL)
+    {
+        pthread_mutex_lock(&log_lock);
+        fprintf(event_log, "{\"inst\":%lld,\"event\":\"%s\"", __atomic_load_n(&inst_count, __ATOMIC_RELAXED), event);
+        if (pid != -1) fprintf(event_log, ",\"pid\":%d", pid);
+        if (v_page != -1) fprintf(event_log, ",\"vpage\":%lld", v_page);
+        if (frame != -1) fprintf(event_log, ",\"frame\":%d", frame);
+        if (slot != -1) fprintf(event_log, ",\"slot\":%d", slot);
+        fputs("}\n", event_log);
+        pthread_mutex_unlock(&log_lock);
+    }
+
+    if (fmt != NULL && log_level >= LOG_EVENTS)
+    {
+        va_list args;
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+    }
+}
+
+// Flushes all buffered output
+void log_close()
+{
+    if (event_log != NULL)
+    {
+        fclose(event_log);
+        event_log = NULL;
+    }
+    fflush(stdout);
+}
+
+// Allocates memory and bookkeeping for the configured geometry
+int init_memory()
+{
+    memory = malloc(mem_size);
+    swap_page = malloc(page_size);
+    copy_page = malloc(page_size);
+    block_page = malloc(page_size);
+    zswap_buffer = zswap_limit > 0 ? malloc(page_size) : NULL;
+    zswap_page = zswap_limit > 0 ? malloc(page_size) : NULL;
+    pid_array = malloc(max_proc * sizeof(int));
+    free_list = malloc(num_frames * sizeof(int));
+    frame_slot = malloc(num_frames * sizeof(int));
+    rmap = malloc(num_frames * sizeof(rmap_entry));
+    prefetch = malloc(max_proc * sizeof(prefetch_state));
+    rss = calloc(max_proc, sizeof(rss_state));
+    frame_prefetched = calloc(num_frames, 1);
+    on_disk = malloc(max_proc * sizeof(int));
+    proc_lock = malloc(max_proc * sizeof(pthread_mutex_t));
+    frame_pinned = calloc(num_frames, 1);
+    frame_huge = calloc(num_frames, 1);
+    frame_sharers = malloc(num_frames * sizeof(int));
+    frame_refs = malloc(num_frames * sizeof(int));
+    tlb = malloc((tlb_size > 0 ? tlb_size : 1) * sizeof(tlb_entry));
+    frame_loaded = calloc(num_frames, sizeof(unsigned int));
+    frame_last_use = calloc(num_frames, sizeof(unsigned int));
+    frame_uses = calloc(num_frames, sizeof(unsigned int));
+    frame_ref = calloc(num_frames, 1);
+    pid_stats = calloc(max_proc, sizeof(vm_stats));
+    frame_stats = calloc(num_frames, sizeof(vm_stats));
+    tlb_hits = calloc(max_proc, sizeof(long long));
+    tlb_misses = calloc(max_proc, sizeof(long long));
+    lat = calloc(max_proc, sizeof(lat_state));
+    if (memory == NULL || swap_page == NULL || copy_page == NULL || block_page == NULL || (zswap_limit > 0 && (zswap_buffer == NULL || zswap_page == NULL)) || pid_array == NULL || free_list == NULL || frame_slot == NULL || rmap == NULL || prefetch == NULL || rss == NULL || frame_prefetched == NULL || on_disk == NULL || proc_lock == NULL || frame_pinned == NULL || frame_loaded == NULL || frame_last_use == NULL || frame_uses == NULL || frame_ref == NULL || pid_stats == NULL || frame_stats == NULL || tlb == NULL || tlb_hits == NULL || tlb_misses == NULL || frame_huge == NULL || frame_sharers == NULL || frame_refs == NULL || lat == NULL)
+    {
+        printf("ERROR: Cannot allocate %d bytes of physical memory\n", mem_size);
+        return -1;
+    }
+
+    // Initialize ptable, free list and disk locations
+    for (int i = 0; i < max_proc; i++)
+    {
+        pid_array[i] = -1;
+        on_disk[i] = -1;
+        pthread_mutex_init(&proc_lock[i], NULL);
+        memset(&prefetch[i], 0, sizeof(prefetch_state));
+        prefetch[i].last_page = -1;
+    }
+    for (int i = 0; i < num_frames; i++)
+    {
+        free_list[i] = -1;
+        frame_slot[i] = -1;
+        rmap[i].pid = -1;
+        frame_sharers[i] = -1;
+        frame_refs[i] = 1;
+    }
+    free_frames = num_frames;
+    for (int i = 0; i < tlb_size; i++)
+    {
+        tlb[i].pid = -1;
+    }
+
+    // Initialize physical memory
+    memset(memory, 0, mem_size);
+
+    return 0;
+}
+
+// Returns a corresponding page based on an address
+long long find_page(long long addr)
+{
+    return addr >> page_shift;
+}
+
+// Returns address of the start of a given page
+int find_address(int page)
+{
+    return page << page_shift;
+}
+
+// Writes the low width bytes of value at a physical address, in the host's byte order
+void write_value(int start, long long value, int width)
+{
+    if (width == 1)
+    {
+        uint8_t v = (uint8_t)value;
+        memcpy(&memory[start], &v, sizeof(v));
+    }
+    else if (width == 2)
+    {
+        uint16_t v = (uint16_t)value;
+        memcpy(&memory[start], &v, sizeof(v));
+    }
+    else if (width == 4)
+    {
+        int32_t v = (int32_t)value;
+        memcpy(&memory[start], &v, sizeof(v));
+    }
+    else
+    {
+        int64_t v = (int64_t)value;
+        memcpy(&memory[start], &v, sizeof(v));
+    }
+}
+
+// Reads a value of width bytes at a physical address, 1 and 2 byte values are unsigned and 4 and 8 byte values are signed
+long long read_value(int start, int width)
+{
+    if (width == 1)
+    {
+        uint8_t v;
+        memcpy(&v, &memory[start], sizeof(v));
+        return v;
+    }
+    else if (width == 2)
+    {
+        uint16_t v;
+        memcpy(&v, &memory[start], sizeof(v));
+        return v;
+    }
+    else if (width == 4)
+    {
+        int32_t v;
+        memcpy(&v, &memory[start], sizeof(v));
+        return v;
+    }
+    int64_t v;
+    memcpy(&v, &memory[start], sizeof(v));
+    return v;
+}
+
+// Reads a page table entry, entry points into physical memory or into the swap file
+pte_t get_pte(unsigned char *entry)
+{
+    pte_t pte;
+    memcpy(&pte, entry, PTE_SIZE);
+    return pte;
+}
+
+// Writes a page table entry, entry points into physical memory or into the swap file
+void set_pte(unsigned char *entry, pte_t pte)
+{
+    memcpy(entry, &pte, PTE_SIZE);
+}
+
+// Returns index of a virtual page's entry in its page table at a level
+int pt_index(long long v_page, int level)
+{
+    return (v_page >> ((level - 1) * pt_bits)) & ((1 << pt_bits) - 1);
+}
+
+// Finds the entry for a virtual page in its page table at a level without bringing any tables into memory
+// Tables on disk are read in place in the swap file, returns NULL if a table on the way does not exist
+unsigned char *find_pte(int pid, long long v_page, int level)
+{
+    unsigned char *table;
+    if (pid_array[pid] != -1)
+    {
+        table = &memory[pid_array[pid]];
+    }
+    else if (on_disk[pid] != -1)
+    {
+        wb_wait(on_disk[pid]);
+        table = &disk_map[(size_t)on_disk[pid] * page_size];
+    }
+    else
+    {
+        return NULL;
+    }
+
+    for (int i = pt_levels; i > level; i--)
+    {
+        pte_t pte = get_pte(&table[pt_index(v_page, i) * PTE_SIZE]);
+        if (!(pte & PTE_VALID))
+        {
+            return NULL;
+        }
+        if (pte & PTE_PRESENT)
+        {
+            table = &memory[find_address(pte >> PTE_FRAME_SHIFT)];
+        }
+        else
+        {
+            wb_wait(pte >> PTE_FRAME_SHIFT); // Tables are changed in place, a queued write must not overwrite that later
+            table = &disk_map[(size_t)(pte >> PTE_FRAME_SHIFT) * page_size];
+        }
+    }
+    return &table[pt_index(v_page, level) * PTE_SIZE];
+}
+
+// Keeps a page table in memory until the running instruction finishes
+void pin_frame(int page)
+{
+    if (!frame_pinned[page])
+    {
+        __atomic_store_n(&frame_pinned[page], 1, __ATOMIC_RELAXED); // Read by other threads' evictions
+        pinned[num_pinned++] = page;
+    }
+}
+
+// Lets the page tables of the last instruction be evicted again
+void unpin_frames()
+{
+    while (num_pinned > 0)
+    {
+        __atomic_store_n(&frame_pinned[pinned[--num_pinned]], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Brings every page table on the path to a virtual page into memory and pins it, creating missing tables if create is set
+// Returns physical address of the virtual page's entry in its level 1 table, or of the level 2 entry of a large page, -1 if a table does not exist or cannot be brought in
+int walk(int pid, long long v_page, int create)
+{
+    return walk_level(pid, v_page, create, 1);
+}
+
+// Same as walk, but stops at the table of level stop and returns the virtual page's entry in it
+int walk_level(int pid, long long v_page, int create, int stop)
+{
+    if (pid_array[pid] == -1 && on_disk[pid] == -1 && !create)
+    {
+        return -1;
+    }
+    if (load_ptable(pid) == -1)
+    {
+        return -1;
+    }
+    int table = pid_array[pid];
+    pin_frame(find_page(table));
+
+    for (int level = pt_levels; level > stop; level--)
+    {
+        int entry = table + pt_index(v_page, level) * PTE_SIZE;
+        pte_t pte = get_pte(&memory[entry]);
+        int p_page;
+        if (pte & PTE_HUGE)
+        {
+            return entry; // Large pages have no level 1 table
+        }
+        if (!(pte & PTE_VALID))
+        {
+            if (!create)
+            {
+                return -1;
+            }
+            p_page = claim_frame(pid, level - 1, v_page & ~(((long long)1 << ((level - 1) * pt_bits)) - 1), -1);
+            if (p_page == -1)
+            {
+                return -1;
+            }
+            memset(&memory[find_address(p_page)], 0, page_size); // No valid entries yet
+            count_fault(pid, 0);
+            LOG_EVENT("ptable_in", pid, -1, p_page, -1, "Put level %d page table for PID %d into physical frame %d\n", level - 1, pid, p_page);
+        }
+        else if (!(pte & PTE_PRESENT))
+        {
+            p_page = claim_frame(pid, level - 1, v_page & ~(((long long)1 << ((level - 1) * pt_bits)) - 1), pte >> PTE_FRAME_SHIFT); // Non-present entries hold the table's swap slot
+            if (p_page == -1)
+            {
+                return -1;
+            }
+            count_fault(pid, 1);
+            LOG_EVENT("ptable_in", pid, -1, p_page, -1, "Put level %d page table for PID %d into physical frame %d\n", level - 1, pid, p_page);
+        }
+        else
+        {
+            p_page = pte >> PTE_FRAME_SHIFT;
+        }
+        set_pte(&memory[entry], ((pte_t)p_page << PTE_FRAME_SHIFT) | PTE_VALID | PTE_PRESENT);
+        table = find_address(p_page);
+        pin_frame(p_page);
+    }
+
+    return table + pt_index(v_page, stop) * PTE_SIZE;
+}
+
+// Returns the physical page an entry maps a virtual page to, large pages map their virtual pages in order onto contiguous physical pages
+int pte_frame(pte_t pte, long long v_page)
+{
+    int p_page = pte >> PTE_FRAME_SHIFT;
+    if (pte & PTE_HUGE)
+    {
+        p_page += v_page & ((1 << pt_bits) - 1);
+    }
+    return p_page;
+}
+
+// Translate page table, return physical address from virtual address
+// Level 1 tables are arrays of pte_t indexed by virtual page, each entry holds the physical frame above its flag bits
+int translate_ptable(int pid, long long v_addr)
+{
+    int entry = walk(pid, find_page(v_addr), 0);
+    pte_t pte = entry == -1 ? 0 : get_pte(&memory[entry]);
+    if (!(pte & PTE_VALID) || !(pte & PTE_PRESENT))
+    {
+        return -1; // Return -1 if address not found
+    }
+    return find_address(pte_frame(pte, find_page(v_addr))) + (v_addr & (page_size - 1));
+}
+
+// Returns the TLB set a translation tag maps to, the tag is the virtual page or, for large pages, the virtual page >> pt_bits
+tlb_entry *tlb_set(int pid, long long tag)
+{
+    return &tlb[((unsigned int)tag + (unsigned int)pid * 31) % tlb_sets * tlb_ways];
+}
+
+// Returns the physical page a virtual page is cached at if its translation has all flags in need, -1 on a miss
+// A large page's entry covers all of its virtual pages, so it is looked up by the large page's tag once base pages miss
+int tlb_lookup(int pid, long long v_page, pte_t need)
+{
+    if (tlb_sets == 0)
+    {
+        return -1;
+    }
+
+    int p_page = -1;
+    pthread_mutex_lock(&tlb_lock);
+    tlb_clock++;
+    for (int huge = 0; huge <= (large_pages > 0) && p_page == -1; huge++)
+    {
+        long long tag = huge ? v_page >> pt_bits : v_page;
+        tlb_entry *set = tlb_set(pid, tag);
+        for (int i = 0; i < tlb_ways; i++)
+        {
+            if (set[i].pid == pid && set[i].v_page == tag && (set[i].flags & PTE_HUGE) == (huge ? PTE_HUGE : 0) && (set[i].flags & need) == need)
+            {
+                set[i].last_use = tlb_clock;
+                p_page = pte_frame(((pte_t)set[i].p_page << PTE_FRAME_SHIFT) | set[i].flags, v_page);
+                break;
+            }
+        }
+    }
+    if (p_page == -1)
+    {
+        tlb_misses[pid]++;
+    }
+    else
+    {
+        tlb_hits[pid]++;
+    }
+    pthread_mutex_unlock(&tlb_lock);
+
+    if (p_page == -1)
+    {
+        LOG(LOG_DEBUG, "TLB miss for PID %d virtual page %lld\n", pid, v_page);
+    }
+    return p_page;
+}
+
+// Caches the translation in a page table entry, replacing the least recently used entry of its set
+void tlb_insert(int pid, long long v_page, pte_t pte)
+{
+    if (tlb_sets == 0)
+    {
+        return;
+    }
+
+    pte_t huge = pte & PTE_HUGE;
+    long long tag = huge ? v_page >> pt_bits : v_page;
+    tlb_entry *set = tlb_set(pid, tag);
+    pthread_mutex_lock(&tlb_lock);
+    tlb_entry *victim = &set[0];
+    for (int i = 0; i < tlb_ways; i++)
+    {
+        if (set[i].pid == pid && set[i].v_page == tag && (set[i].flags & PTE_HUGE) == huge)
+        {
+            victim = &set[i]; // Update existing entry
+            break;
+        }
+        if (set[i].pid == -1 || (victim->pid != -1 && set[i].last_use < victim->last_use))
+        {
+            victim = &set[i];
+        }
+    }
+
+    victim->pid = pid;
+    victim->v_page = tag;
+    victim->p_page = pte >> PTE_FRAME_SHIFT;
+    victim->flags = pte & PTE_FLAGS;
+    victim->last_use = tlb_clock;
+    pthread_mutex_unlock(&tlb_lock);
+}
+
+// Drops the cached translation of a virtual page, must be called whenever its PTE changes
+void tlb_invalidate(int pid, long long v_page)
+{
+    if (tlb_sets == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&tlb_lock);
+    for (int huge = 0; huge <= (large_pages > 0); huge++)
+    {
+        long long tag = huge ? v_page >> pt_bits : v_page;
+        tlb_entry *set = tlb_set(pid, tag);
+        for (int i = 0; i < tlb_ways; i++)
+        {
+            if (set[i].pid == pid && set[i].v_page == tag && (set[i].flags & PTE_HUGE) == (huge ? PTE_HUGE : 0))
+            {
+                set[i].pid = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&tlb_lock);
+}
+
+// Drops the cached translations of count virtual pages from first, for instructions that change many PTEs at once
+// A single pass over the TLB replaces a lookup per page, and drops the entries of large pages that overlap the range
+void tlb_invalidate_range(int pid, long long first, long long count)
+{
+    if (tlb_sets == 0 || count <= 0)
+    {
+        return;
+    }
+    if (count == 1)
+    {
+        tlb_invalidate(pid, first);
+        return;
+    }
+
+    pthread_mutex_lock(&tlb_lock);
+    for (int i = 0; i < tlb_size; i++)
+    {
+        if (tlb[i].pid != pid)
+        {
+            continue;
+        }
+        long long low = (tlb[i].flags & PTE_HUGE) ? tlb[i].v_page << pt_bits : tlb[i].v_page;
+        long long high = (tlb[i].flags & PTE_HUGE) ? low + (1 << pt_bits) - 1 : low;
+        if (high >= first && low < first + count)
+        {
+            tlb[i].pid = -1;
+        }
+    }
+    pthread_mutex_unlock(&tlb_lock);
+}
+
+// Prints TLB hit rate per process
+void tlb_report()
+{
+    if (tlb_sets == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < max_proc; i++)
+    {
+        long long lookups = tlb_hits[i] + tlb_misses[i];
+        if (lookups > 0)
+        {
+            LOG(LOG_SUMMARY, "TLB for PID %d: %lld hits, %lld misses (%.1f%% hit rate)\n", i, tlb_hits[i], tlb_misses[i], 100.0 * tlb_hits[i] / lookups);
+        }
+    }
+}
+
+// Counts a fault of a process, handling it costs lat_fault of simulated time on top of any disk I/O
+void count_fault(int pid, int major)
+{
+    if (major)
+    {
+        pid_stats[pid].major_faults++;
+    }
+    else
+    {
+        pid_stats[pid].minor_faults++;
+    }
+    lat_cost += lat_fault;
+}
+
+// Queues an I/O of cost nanoseconds on the simulated disk, it starts once the I/O queued before it is done
+// The running instruction waits until the disk has at most slack nanoseconds of I/O left, unless the I/O is issued ahead of demand
+void lat_disk(long long cost, long long slack)
+{
+    long long now = __atomic_load_n(&sim_time, __ATOMIC_RELAXED) + lat_cost;
+    long long start = disk_free_at > now ? disk_free_at : now;
+    disk_free_at = start + cost;
+    if (!lat_async && disk_free_at - now > slack)
+    {
+        long long wait = disk_free_at - slack - now;
+        disk_wait += wait < start - now ? wait : start - now;
+        lat_cost += wait;
+    }
+}
+
+// Returns the histogram bucket of a latency, exact below 1 << LAT_SUB_BITS and logarithmic above
+int lat_bucket(long long ns)
+{
+    if (ns < (1 << LAT_SUB_BITS))
+    {
+        return ns < 0 ? 0 : ns;
+    }
+    int top = 63 - __builtin_clzll(ns);
+    return ((top - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + ((ns >> (top - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+// Returns the latency that the given share of a histogram's accesses stay within, the highest latency of the bucket it falls in
+long long lat_percentile(long long *hist, long long count, double share)
+{
+    long long rank = (long long)(share * count);
+    long long seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++)
+    {
+        seen += hist[i];
+        if (seen > rank)
+        {
+            // One below the lowest latency of the next bucket
+            int next = i + 1;
+            if (next <= (1 << LAT_SUB_BITS))
+            {
+                return next - 1;
+            }
+            int top = (next >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+            return (((1LL << LAT_SUB_BITS) + (next & ((1 << LAT_SUB_BITS) - 1))) << (top - LAT_SUB_BITS)) - 1;
+        }
+    }
+    return 0;
+}
+
+// Prints each process's effective access time, latency percentiles and stall time, then the totals
+// A process stalls for all of its simulated time beyond a TLB hit per access
+void latency_report()
+{
+    if (!latency_model)
+    {
+        return;
+    }
+
+    static lat_state total; // Too large for a worker thread's stack
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < max_proc; i++)
+    {
+        lat_state *l = &lat[i];
+        if (l->accesses == 0 && l->time == 0)
+        {
+            continue;
+        }
+        LOG(LOG_SUMMARY, "Latency for PID %d: %lld accesses, %.1f ns effective access time, p50 %lld ns, p99 %lld ns, p99.9 %lld ns, stalled %.3f of %.3f ms\n",
+            i, l->accesses, l->accesses ? (double)l->access_time / l->accesses : 0.0, lat_percentile(l->hist, l->accesses, 0.5),
+            lat_percentile(l->hist, l->accesses, 0.99), lat_percentile(l->hist, l->accesses, 0.999),
+            (l->time - l->accesses * lat_tlb) / 1e6, l->time / 1e6);
+        total.accesses += l->accesses;
+        total.access_time += l->access_time;
+        for (int j = 0; j < LAT_BUCKETS; j++)
+        {
+            total.hist[j] += l->hist[j];
+        }
+    }
+    LOG(LOG_SUMMARY, "Latency: %lld accesses, %.1f ns effective access time, p50 %lld ns, p99 %lld ns, p99.9 %lld ns, %.3f ms of simulated time, %.3f ms waiting for the disk behind other I/O\n",
+        total.accesses, total.accesses ? (double)total.access_time / total.accesses : 0.0, lat_percentile(total.hist, total.accesses, 0.5),
+        lat_percentile(total.hist, total.accesses, 0.99), lat_percentile(total.hist, total.accesses, 0.999),
+        __atomic_load_n(&sim_time, __ATOMIC_RELAXED) / 1e6, disk_wait / 1e6);
+}
+
+// Adds one set of counters to another
+void stats_add(vm_stats *total, vm_stats *add)
+{
+    total->accesses += add->accesses;
+    total->hits += add->hits;
+    total->minor_faults += add->minor_faults;
+    total->major_faults += add->major_faults;
+    total->swap_ins += add->swap_ins;
+    total->swap_outs += add->swap_outs;
+    total->clean_evictions += add->clean_evictions;
+    total->ptable_evictions += add->ptable_evictions;
+    total->wp_faults += add->wp_faults;
+    total->bytes_to_disk += add->bytes_to_disk;
+    total->bytes_from_disk += add->bytes_from_disk;
+}
+
+// Prints counters per process, per physical frame and in total, followed by the TLB hit rates
+void stats_report()
+{
+    vm_stats total;
+    memset(&total, 0, sizeof(total));
+
+    LOG(LOG_SUMMARY, "Statistics after %lld instructions with replacement policy %s:\n", inst_count, cur_policy->name);
+    for (int i = 0; i < max_proc; i++)
+    {
+        vm_stats *s = &pid_stats[i];
+        if (s->accesses + s->minor_faults + s->major_faults + s->swap_outs + s->clean_evictions + s->wp_faults > 0)
+        {
+            LOG(LOG_SUMMARY, "PID %d: %lld accesses, %lld hits, %lld minor faults, %lld major faults, %lld swap-ins, %lld swap-outs, %lld clean evictions, %lld page table evictions, %lld write protection faults, %lld bytes to disk, %lld bytes from disk\n",
+                i, s->accesses, s->hits, s->minor_faults, s->major_faults, s->swap_ins, s->swap_outs, s->clean_evictions, s->ptable_evictions, s->wp_faults, s->bytes_to_disk, s->bytes_from_disk);
+        }
+        stats_add(&total, s);
+    }
+    LOG(LOG_SUMMARY, "Total: %lld accesses, %lld hits, %lld minor faults, %lld major faults, %lld swap-ins, %lld swap-outs, %lld clean evictions, %lld page table evictions, %lld write protection faults, %lld bytes to disk, %lld bytes from disk\n",
+        total.accesses, total.hits, total.minor_faults, total.major_faults, total.swap_ins, total.swap_outs, total.clean_evictions, total.ptable_evictions, total.wp_faults, total.bytes_to_disk, total.bytes_from_disk);
+    if (run_seconds >= 0)
+    {
+        long long faults = total.minor_faults + total.major_faults;
+        LOG(LOG_SUMMARY, "Ran %d instructions in %.3f seconds: %.0f accesses per second, %.2f faults per 100 accesses, %lld swap-ins, %lld swap-outs\n",
+            trace_len, run_seconds, run_seconds > 0 ? total.accesses / run_seconds : 0, total.accesses > 0 ? 100.0 * faults / total.accesses : 0, total.swap_ins, total.swap_outs);
+    }
+
+    for (int i = 0; i < num_frames; i++)
+    {
+        vm_stats *s = &frame_stats[i];
+        if (s->swap_ins + s->swap_outs + s->clean_evictions > 0)
+        {
+            LOG(LOG_SUMMARY, "Frame %d: %lld swap-ins, %lld swap-outs, %lld clean evictions, %lld page table evictions\n", i, s->swap_ins, s->swap_outs, s->clean_evictions, s->ptable_evictions);
+        }
+    }
+
+    if (wb_depth > 0)
+    {
+        pthread_mutex_lock(&wb_lock);
+        LOG(LOG_SUMMARY, "Write-back queue: %lld pages written, %lld writes merged, %lld stalls on a full queue\n", wb_written, wb_merged, wb_stalls);
+        pthread_mutex_unlock(&wb_lock);
+    }
+
+    if (fork_count > 0)
+    {
+        int shared = 0;
+        long long mappings = 0;
+        for (int i = 0; i < num_frames; i++)
+        {
+            if (free_list[i] != -1 && frame_refs[i] > 1)
+            {
+                shared++;
+                mappings += frame_refs[i];
+            }
+        }
+        LOG(LOG_SUMMARY, "Fork: %d forks, %lld copy-on-write faults, %lld pages copied, %d physical pages shared by %lld mappings\n", fork_count, cow_faults, cow_copies, shared, mappings);
+    }
+
+    if (demand_zero)
+    {
+        LOG(LOG_SUMMARY, "Demand-zero: %lld pages mapped to the zero page, %lld loads from the zero page, %lld pages given a physical page by their first store\n", zero_maps, zero_reads, zero_fills);
+    }
+
+    if (unmapped_pages > 0)
+    {
+        LOG(LOG_SUMMARY, "Unmap: %lld pages unmapped, %lld physical frames and %lld swap slots freed\n", unmapped_pages, freed_frames, freed_slots);
+    }
+
+    if (shm_count > 0)
+    {
+        int resident = 0;
+        long long mappings = 0;
+        for (int i = 0; i <= shm_mask; i++)
+        {
+            pte_t pte = shm_table[i].pid == -1 ? 0 : get_pte(find_pte(shm_table[i].pid, shm_table[i].v_page, 1));
+            if (pte & PTE_PRESENT)
+            {
+                resident++;
+                mappings += frame_refs[pte >> PTE_FRAME_SHIFT];
+            }
+        }
+        LOG(LOG_SUMMARY, "Shared memory: %d shared pages, %d of them in memory with %lld mappings\n", shm_count, resident, mappings);
+    }
+
+    zswap_report();
+    prefetch_report();
+    rss_report();
+    tlb_report();
+    latency_report();
+}
+
+// Feeds a demand miss (fault is 1) or the first access to a prefetched page (fault is 0) to the prefetcher
+// Once two in a row are the same stride apart, the next prefetch_window pages along the stride are swapped in
+// Prefetching stays inside the level 1 page table of the access, which the access already holds in memory
+void prefetch_access(int pid, long long v_page, int pte_addr, int fault)
+{
+    prefetch_state *s = &prefetch[pid];
+    int p_page = get_pte(&memory[pte_addr]) >> PTE_FRAME_SHIFT;
+    if (fault)
+    {
+        s->faults++;
+    }
+    else
+    {
+        frame_prefetched[p_page] = 0;
+        s->used++;
+    }
+
+    long long stride = v_page - s->last_page;
+    int confirmed = s->last_page != -1 && stride != 0 && stride == s->stride;
+    s->stride = stride;
+    s->last_page = v_page;
+    if (!confirmed || prefetch_window == 0)
+    {
+        return;
+    }
+
+    pin_frame(p_page); // Prefetching must not evict the page that was just accessed
+    int table = pte_addr - pt_index(v_page, 1) * PTE_SIZE;
+    lat_async = 1; // The access does not wait for the pages read ahead of it
+    for (int i = 1; i <= prefetch_window; i++)
+    {
+        long long target = v_page + i * stride;
+        if (target < 0 || target >= max_pages || (target >> pt_bits) != (v_page >> pt_bits))
+        {
+            break; // Outside this page table
+        }
+        if (rss_cap > 0 && rss[pid].pages >= rss_cap)
+        {
+            break; // Prefetched pages would push the process's own pages out
+        }
+
+        pte_t pte = get_pte(&memory[table + pt_index(target, 1) * PTE_SIZE]);
+        if (!(pte & PTE_VALID) || (pte & PTE_PRESENT) || pte_zero(pte) || slot_refs[pte >> PTE_FRAME_SHIFT] > 1)
+        {
+            continue; // Not mapped, already in memory, never stored to, or shared with processes that may have it in memory
+        }
+        int frame = claim_frame(pid, 0, target, pte >> PTE_FRAME_SHIFT);
+        if (frame == -1)
+        {
+            break;
+        }
+        remap(pid, target, frame);
+        frame_prefetched[frame] = 1;
+        s->prefetches++;
+        LOG_EVENT("prefetch", pid, target, frame, pte >> PTE_FRAME_SHIFT, "Prefetched virtual page %lld into physical frame %d\n", target, frame);
+    }
+    lat_async = 0;
+}
+
+// Prints how many prefetched pages were used (accuracy) and how many misses prefetching avoided (coverage) per process
+void prefetch_report()
+{
+    for (int i = 0; i < max_proc; i++)
+    {
+        prefetch_state *s = &prefetch[i];
+        if (s->prefetches > 0)
+        {
+            LOG(LOG_SUMMARY, "Prefetch for PID %d: %lld pages prefetched, %lld used (%.1f%% accuracy, %.1f%% coverage)\n",
+                i, s->prefetches, s->used, 100.0 * s->used / s->prefetches, 100.0 * s->used / (s->used + s->faults));
+        }
+    }
+}
+
+// Allocates page table entry into virtual page, returns -1 if there is no physical page for it
+int create_ptable(int pid)
+{
+    int p_page = claim_frame(pid, pt_levels, 0, -1);
+    if (p_page == -1)
+    {
+        return -1;
+    }
+    pid_array[pid] = find_address(p_page);
+    memset(&memory[pid_array[pid]], 0, page_size); // No valid entries yet
+    count_fault(pid, 0);
+    LOG_EVENT("ptable_in", pid, -1, p_page, -1, "Put page table for PID %d into physical frame %d\n", pid, p_page);
+
+    return p_page;
+}
+
+// Makes sure a process's page table is in physical memory, creating it if it does not exist, returns -1 if there is no physical page for it
+int load_ptable(int pid)
+{
+    if (pid_array[pid] != -1)
+    {
+        return 0; // Already in memory
+    }
+    if (on_disk[pid] == -1)
+    {
+        return create_ptable(pid) == -1 ? -1 : 0;
+    }
+
+    int p_page = claim_frame(pid, pt_levels, 0, on_disk[pid]);
+    if (p_page == -1)
+    {
+        return -1;
+    }
+    on_disk[pid] = -1;
+    count_fault(pid, 1);
+    pid_array[pid] = find_address(p_page);
+    LOG_EVENT("ptable_in", pid, -1, p_page, -1, "Put page table for PID %d into physical frame %d\n", pid, p_page);
+
+    return 0;
+}
+
+// Maps virtual page to physical page, or every virtual page of the len bytes from v_addr if len is not 0
+// Pages that are already mapped get the new permissions, their translations are dropped from the TLB once for the whole range
+int map(int pid, long long v_addr, int r_value, int len)
+{
+    long long first = find_page(v_addr);
+    long long last = range_last(v_addr, len);
+    long long changed = -1; // First page whose entry changed permissions
+    int run = 1 << pt_bits;
+    if (last == -1)
+    {
+        return 0;
+    }
+    if (r_value & 2)
+    {
+        pte_t rw_bit = (r_value & 1) ? PTE_WRITE : 0;
+        if (pt_levels < 2)
+        {
+            return map_large(pid, v_addr, rw_bit); // Reports that large pages need two levels
+        }
+        for (long long v_page = first; v_page <= last; v_page = (v_page | (run - 1)) + 1)
+        {
+            map_large(pid, v_page == first ? v_addr : v_page << page_shift, rw_bit);
+            unpin_frames();
+        }
+        return 0;
+    }
+
+    for (long long v_page = first; v_page <= last; v_page++)
+    {
+        long long page_addr = v_page == first ? v_addr : v_page << page_shift;
+        pte_t rw_bit = (r_value & 1) ? PTE_WRITE : 0;
+
+        // Create page tables for process if they do not exist
+        int entry = walk(pid, v_page, 1);
+        if (entry == -1)
+        {
+            break; // No physical page for a table
+        }
+
+        // Check if entry already exists and update it
+        pte_t pte = get_pte(&memory[entry]);
+        if (pte & PTE_VALID)
+        {
+            if (((pte & (PTE_WRITE | PTE_COW)) != 0) == (rw_bit != 0)) LOG(LOG_EVENTS, "ERROR: virtual page %lld is already mapped with rw_bit=%d\n", v_page, rw_bit != 0);
+            if (rw_bit && !(pte & PTE_SHARED) && page_shared(pte))
+            {
+                rw_bit = PTE_COW; // Writable, but the first store copies the page
+            }
+            set_pte(&memory[entry], (pte & ~(PTE_WRITE | PTE_COW)) | rw_bit);
+            changed = changed == -1 ? v_page : changed;
+            if (pte & PTE_HUGE)
+            {
+                v_page |= run - 1; // The entry covers the rest of the large page
+            }
+        }
+
+        // Create new entry, a demand-zero page gets its physical page on its first store
+        else if (demand_zero)
+        {
+            set_pte(&memory[entry], ((pte_t)ZERO_SLOT << PTE_FRAME_SHIFT) | PTE_VALID | rw_bit);
+            zero_maps++;
+            LOG_EVENT("map", pid, v_page, -1, -1, "Mapped virtual address %lld (page %lld) to the zero page\n", page_addr, v_page);
+        }
+        else
+        {
+            int p_page = claim_frame(pid, 0, v_page, -1);
+            if (p_page == -1)
+            {
+                break;
+            }
+            set_pte(&memory[entry], ((pte_t)p_page << PTE_FRAME_SHIFT) | PTE_VALID | PTE_PRESENT | rw_bit);
+            count_fault(pid, 0);
+            LOG_EVENT("map", pid, v_page, p_page, -1, "Mapped virtual address %lld (page %lld) into physical frame %d\n", page_addr, v_page, p_page);
+        }
+
+        // Done with this page table, so a long range does not pin every table it passes through
+        if ((v_page & (run - 1)) == run - 1)
+        {
+            unpin_frames();
+        }
+    }
+    if (changed != -1)
+    {
+        tlb_invalidate_range(pid, changed, last - changed + 1);
+    }
+
+    return 0; // Success
+}
+
+// Maps the large page holding a virtual address, 1 << pt_bits virtual pages behind a single level 2 entry
+// The large page needs as many contiguous physical pages, so it needs at least two levels of page tables
+int map_large(int pid, long long v_addr, pte_t rw_bit)
+{
+    int run = 1 << pt_bits;
+    long long v_page = find_page(v_addr) & ~(long long)(run - 1);
+    if (pt_levels < 2)
+    {
+        LOG(LOG_EVENTS, "ERROR: Large pages need at least two levels of page tables, use more virtual pages\n");
+        return 0;
+    }
+
+    int entry = walk_level(pid, v_page, 1, 2);
+    if (entry == -1)
+    {
+        return 0;
+    }
+    pte_t pte = get_pte(&memory[entry]);
+    if (pte & PTE_VALID)
+    {
+        if (!(pte & PTE_HUGE))
+        {
+            LOG(LOG_EVENTS, "ERROR: Virtual pages %lld to %lld are already mapped as small pages\n", v_page, v_page + run - 1);
+            return 0;
+        }
+        if ((pte & PTE_WRITE) == rw_bit) LOG(LOG_EVENTS, "ERROR: virtual page %lld is already mapped with rw_bit=%d\n", v_page, rw_bit != 0);
+        set_pte(&memory[entry], (pte & ~PTE_WRITE) | rw_bit);
+        tlb_invalidate(pid, v_page);
+        return 0;
+    }
+
+    int p_page = claim_large(pid, v_page);
+    if (p_page == -1)
+    {
+        LOG(LOG_EVENTS, "ERROR: There are no %d contiguous physical frames that can be used for a large page\n", run);
+        return 0;
+    }
+    set_pte(&memory[entry], ((pte_t)p_page << PTE_FRAME_SHIFT) | PTE_VALID | PTE_PRESENT | PTE_HUGE | rw_bit);
+    large_pages++;
+    count_fault(pid, 0);
+    LOG_EVENT("map", pid, v_page, p_page, -1, "Mapped virtual address %lld (large page of pages %lld to %lld) into physical frames %d to %d\n", v_addr, v_page, v_page + run - 1, p_page, p_page + run - 1);
+    return 0;
+}
+
+// Returns the first of 1 << pt_bits physical pages for a large page starting at v_page, -1 if no aligned run can be used
+// The run with the most free pages is taken, and every page still in it is evicted
+int claim_large(int pid, long long v_page)
+{
+    int run = 1 << pt_bits;
+    int best = -1;
+    int best_free = -1;
+    if (num_frames - (large_pages + 1) * run < pt_levels + 2 + free_target + prefetch_window)
+    {
+        return -1; // Small pages must still have room for a page table walk, the free pool and prefetching
+    }
+    for (int start = 0; start + run <= num_frames; start += run)
+    {
+        int free_count = 0;
+        int usable = 1;
+        for (int i = start; i < start + run && usable; i++)
+        {
+            if (free_list[i] == -1)
+            {
+                free_count++;
+            }
+            else if (!can_evict(pid, i))
+            {
+                usable = 0;
+            }
+        }
+        if (usable && free_count > best_free)
+        {
+            best = start;
+            best_free = free_count;
+        }
+    }
+    if (best == -1)
+    {
+        return -1;
+    }
+
+    for (int i = best; i < best + run; i++)
+    {
+        if (free_list[i] == -1)
+        {
+            free_frames--;
+        }
+        else
+        {
+            evict_page(pid, i, -1);
+        }
+        free_list[i] = 0;
+        frame_slot[i] = -1;
+        frame_huge[i] = 1;
+        frame_prefetched[i] = 0;
+        rmap[i].pid = pid;
+        rmap[i].level = 0;
+        rss_add(pid, 1);
+        rmap[i].v_page = v_page + (i - best);
+        memset(&memory[find_address(i)], 0, page_size);
+        policy_load(i);
+    }
+    return best;
+}
+
+// Clones the address space of pid into the empty process child
+// Page tables are copied, data pages and their swap slots are shared and both processes get copy-on-write entries for writable ones
+int fork_process(int pid, int child)
+{
+    if (child < 0 || child >= max_proc || child == pid)
+    {
+        LOG(LOG_EVENTS, "ERROR: Process ID %d cannot be forked into\n", child);
+        return 0;
+    }
+    if (pid_array[child] != -1 || on_disk[child] != -1)
+    {
+        LOG(LOG_EVENTS, "ERROR: Process %d already has a page table, only an empty process can be forked into\n", child);
+        return 0;
+    }
+
+    // The child's worker thread must not run on its tables while they are built
+    if (num_threads > 0)
+    {
+        lock_process(child);
+    }
+    fork_table(pid, child, pt_levels, 0);
+    fork_count++;
+    LOG_EVENT("fork", pid, -1, -1, -1, "Forked process %d into process %d\n", pid, child);
+    if (num_threads > 0)
+    {
+        pthread_mutex_unlock(&proc_lock[child]);
+    }
+    return 0;
+}
+
+// Clones the entries of pid's page table at level that covers the virtual pages from base
+// Entries are looked up again for every page, as making the child's tables can evict the parent's
+void fork_table(int pid, int child, int level, long long base)
+{
+    for (int i = 0; i < (1 << pt_bits); i++)
+    {
+        long long v_page = base + ((long long)i << ((level - 1) * pt_bits));
+        if (v_page >= max_pages)
+        {
+            break;
+        }
+        unsigned char *entry = find_pte(pid, v_page, level);
+        pte_t pte = entry == NULL ? 0 : get_pte(entry);
+        if (!(pte & PTE_VALID))
+        {
+            continue;
+        }
+
+        if (pte & PTE_HUGE)
+        {
+            // Large pages are never shared, the child gets its own copy right away
+            map_large(child, v_page << page_shift, pte & PTE_WRITE);
+            unsigned char *copy = find_pte(child, v_page, 2);
+            if (copy != NULL && (get_pte(copy) & PTE_HUGE))
+            {
+                memcpy(&memory[find_address(get_pte(copy) >> PTE_FRAME_SHIFT)], &memory[find_address(pte >> PTE_FRAME_SHIFT)], (size_t)page_size << pt_bits);
+            }
+            unpin_frames();
+        }
+        else if (level > 1)
+        {
+            fork_table(pid, child, level - 1, v_page);
+        }
+        else
+        {
+            fork_page(pid, child, v_page);
+        }
+    }
+}
+
+// Maps the data page at v_page of pid into child, a writable page loses write permission in both and is copied on the first store
+void fork_page(int pid, int child, long long v_page)
+{
+    int child_entry = walk(child, v_page, 1);
+    if (child_entry == -1)
+    {
+        LOG(LOG_EVENTS, "ERROR: No physical frame for the page tables of process %d, virtual page %lld not forked\n", child, v_page);
+        unpin_frames();
+        return;
+    }
+    unsigned char *entry = find_pte(pid, v_page, 1);
+    pte_t pte = get_pte(entry);
+    if ((pte & PTE_WRITE) && !(pte & PTE_SHARED) && !pte_zero(pte)) // Shared memory stays shared, a zero page entry has nothing to copy
+    {
+        pte = (pte & ~PTE_WRITE) | PTE_COW;
+        set_pte(entry, pte);
+        tlb_invalidate(pid, v_page);
+    }
+
+    if (pte & PTE_PRESENT)
+    {
+        int page = pte >> PTE_FRAME_SHIFT;
+        share_add(page, child, v_page);
+        if (frame_slot[page] != -1)
+        {
+            slot_refs[frame_slot[page]]++;
+        }
+    }
+    else if (!pte_zero(pte))
+    {
+        slot_refs[pte >> PTE_FRAME_SHIFT]++;
+    }
+    set_pte(&memory[child_entry], pte);
+    unpin_frames();
+}
+
+// Handles a store to a copy-on-write page in memory, if other processes still map the page it is copied into a new physical page
+// The writer gives up the page's swap slot to the processes still sharing it, and gets a slot of its own when it is next evicted
+// Returns -1 if no physical page can be claimed for the copy
+int cow_break(int pid, long long v_page, int pte_addr)
+{
+    pte_t pte = get_pte(&memory[pte_addr]);
+    int page = pte >> PTE_FRAME_SHIFT;
+    cow_faults++;
+    if (frame_refs[page] > 1)
+    {
+        // The page is copied aside first, so with every other frame pinned it can be evicted to make room for its own copy
+        memcpy(copy_page, &memory[find_address(page)], page_size);
+        int copy = claim_frame(pid, 0, v_page, -1);
+        if (copy == -1)
+        {
+            LOG(LOG_EVENTS, "ERROR: No physical frame for a copy of virtual page %lld, value not stored\n", v_page);
+            return -1;
+        }
+        memcpy(&memory[find_address(copy)], copy_page, page_size);
+        pte_t now = get_pte(&memory[pte_addr]);
+        if (now & PTE_PRESENT)
+        {
+            share_remove(page, pid, v_page);
+            if (frame_slot[page] != -1)
+            {
+                slot_refs[frame_slot[page]]--;
+            }
+        }
+        else
+        {
+            slot_refs[now >> PTE_FRAME_SHIFT]--; // Evicted for the copy, the other processes keep its swap slot
+        }
+        pte = (pte & PTE_FLAGS & ~PTE_DIRTY) | ((pte_t)copy << PTE_FRAME_SHIFT);
+        cow_copies++;
+        count_fault(pid, 0);
+        if (now & PTE_PRESENT)
+        {
+            LOG_EVENT("cow", pid, v_page, copy, -1, "Copied physical frame %d into frame %d for a store by PID %d\n", page, copy, pid);
+        }
+        else
+        {
+            LOG_EVENT("cow", pid, v_page, copy, -1, "Copied physical frame %d into frame %d for a store by PID %d, evicting the shared page to make room\n", page, copy, pid);
+        }
+    }
+    else if (frame_slot[page] != -1 && slot_refs[frame_slot[page]] > 1)
+    {
+        slot_refs[frame_slot[page]]--;
+        frame_slot[page] = -1;
+    }
+    set_pte(&memory[pte_addr], (pte & ~PTE_COW) | PTE_WRITE);
+    tlb_invalidate(pid, v_page);
+    return 0;
+}
+
+// Maps the virtual page at v_addr to shared memory page key, read and write
+// The first process to map a key gets a new physical page, later ones map the same physical page or swap slot
+int map_shared(int pid, long long v_addr, int key)
+{
+    long long v_page = find_page(v_addr);
+    int entry = walk(pid, v_page, 1);
+    if (entry == -1)
+    {
+        return 0;
+    }
+    pte_t pte = get_pte(&memory[entry]);
+    if (pte & PTE_VALID)
+    {
+        LOG(LOG_EVENTS, "ERROR: Virtual page %lld is already mapped\n", v_page);
+        return 0;
+    }
+
+    int slot = shm_find(key);
+    if (slot == -1)
+    {
+        int p_page = claim_frame(pid, 0, v_page, -1);
+        if (p_page == -1)
+        {
+            return 0;
+        }
+        set_pte(&memory[entry], ((pte_t)p_page << PTE_FRAME_SHIFT) | PTE_VALID | PTE_PRESENT | PTE_WRITE | PTE_SHARED);
+        shm_add(key, pid, v_page);
+        count_fault(pid, 0);
+        LOG_EVENT("map", pid, v_page, p_page, -1, "Mapped virtual address %lld (page %lld) into physical frame %d as shared page %d\n", v_addr, v_page, p_page, key);
+        return 0;
+    }
+
+    // The first mapper's worker thread must not run on its entry while the page gains a mapper
+    shm_entry *shm = &shm_table[slot];
+    int locked = num_threads > 0 && shm->pid != pid && shm->pid != held_pid;
+    if (locked)
+    {
+        lock_process(shm->pid);
+    }
+    pte_t first = get_pte(find_pte(shm->pid, shm->v_page, 1));
+    int index = first >> PTE_FRAME_SHIFT;
+    if (first & PTE_PRESENT)
+    {
+        share_add(index, pid, v_page);
+        if (frame_slot[index] != -1)
+        {
+            slot_refs[frame_slot[index]]++;
+        }
+    }
+    else
+    {
+        slot_refs[index]++;
+    }
+    set_pte(&memory[entry], ((pte_t)index << PTE_FRAME_SHIFT) | (first & PTE_PRESENT) | PTE_VALID | PTE_WRITE | PTE_SHARED);
+    LOG_EVENT("share", pid, v_page, first & PTE_PRESENT ? index : -1, first & PTE_PRESENT ? -1 : index, "Mapped virtual address %lld (page %lld) to shared page %d, which PID %d maps at virtual page %lld\n", v_addr, v_page, key, shm->pid, shm->v_page);
+    if (locked)
+    {
+        pthread_mutex_unlock(&proc_lock[shm->pid]);
+    }
+    return 0;
+}
+
+// Returns the slot of a shared memory key in its hash table, -1 if no process has mapped it yet
+int shm_find(int key)
+{
+    if (shm_mask == -1)
+    {
+        return -1;
+    }
+    int slot = (int)(((unsigned long long)(unsigned int)key * 0x9E3779B97F4A7C15ULL) >> 32) & shm_mask;
+    while (shm_table[slot].pid != -1)
+    {
+        if (shm_table[slot].key == key)
+        {
+            return slot;
+        }
+        slot = (slot + 1) & shm_mask;
+    }
+    return -1;
+}
+
+// Records the first virtual page mapped to a shared memory key, the hash table doubles once it is half full
+void shm_add(int key, int pid, long long v_page)
+{
+    if (2 * (shm_count + 1) > shm_mask + 1)
+    {
+        shm_entry *old = shm_table;
+        int old_size = shm_mask + 1;
+        int size = old_size == 0 ? 64 : old_size * 2;
+        shm_table = malloc(size * sizeof(shm_entry));
+        shm_mask = size - 1;
+        shm_count = 0;
+        for (int i = 0; i < size; i++)
+        {
+            shm_table[i].pid = -1;
+        }
+        for (int i = 0; i < old_size; i++)
+        {
+            if (old[i].pid != -1)
+            {
+                shm_add(old[i].key, old[i].pid, old[i].v_page);
+            }
+        }
+        free(old);
+    }
+
+    int slot = (int)(((unsigned long long)(unsigned int)key * 0x9E3779B97F4A7C15ULL) >> 32) & shm_mask;
+    while (shm_table[slot].pid != -1)
+    {
+        slot = (slot + 1) & shm_mask;
+    }
+    shm_table[slot].key = key;
+    shm_table[slot].pid = pid;
+    shm_table[slot].v_page = v_page;
+    shm_count++;
+}
+
+// Returns 1 if another process also maps the physical page or swap slot that a data page entry points to
+int page_shared(pte_t pte)
+{
+    int index = pte >> PTE_FRAME_SHIFT;
+    if (!(pte & PTE_PRESENT))
+    {
+        return index != ZERO_SLOT && slot_refs[index] > 1;
+    }
+    return frame_refs[index] > 1 || (frame_slot[index] != -1 && slot_refs[frame_slot[index]] > 1);
+}
+
+// Returns 1 if a data page entry maps the zero page
+int pte_zero(pte_t pte)
+{
+    return (pte & (PTE_VALID | PTE_PRESENT)) == PTE_VALID && (int)(pte >> PTE_FRAME_SHIFT) == ZERO_SLOT;
+}
+
+// Moves the shared memory key first mapped at a page that was just unmapped to another page still mapping it
+// A key that no page maps any more is removed, and the keys after it in its cluster are added again so lookups still reach them
+void shm_release(int pid, long long v_page, pte_t pte)
+{
+    int slot = 0;
+    while (slot <= shm_mask && !(shm_table[slot].pid == pid && shm_table[slot].v_page == v_page))
+    {
+        slot++;
+    }
+    if (slot > shm_mask)
+    {
+        return; // Not the page its key was first mapped at
+    }
+
+    int found_pid = -1;
+    long long found_vpage = -1;
+    for (int i = 0; i < max_proc && found_pid == -1; i++)
+    {
+        // Other processes' worker threads must not change their entries while they are searched
+        int locked = num_threads > 0 && i != pid && i != held_pid;
+        if (locked)
+        {
+            lock_process(i);
+        }
+        shm_search(i, pt_levels, 0, pte, &found_pid, &found_vpage);
+        if (locked)
+        {
+            pthread_mutex_unlock(&proc_lock[i]);
+        }
+    }
+    if (found_pid != -1)
+    {
+        shm_table[slot].pid = found_pid;
+        shm_table[slot].v_page = found_vpage;
+        return;
+    }
+
+    shm_table[slot].pid = -1;
+    shm_count--;
+    for (int i = (slot + 1) & shm_mask; shm_table[i].pid != -1; i = (i + 1) & shm_mask)
+    {
+        shm_entry moved = shm_table[i];
+        shm_table[i].pid = -1;
+        shm_count--;
+        shm_add(moved.key, moved.pid, moved.v_page);
+    }
+}
+
+// Looks under pid's page table at level that covers the virtual pages from base for a shared memory entry mapping the same page as pte
+// Returns 1 and sets the process and virtual page of the entry if there is one
+int shm_search(int pid, int level, long long base, pte_t pte, int *found_pid, long long *found_vpage)
+{
+    int index = pte >> PTE_FRAME_SHIFT;
+    int slot = (pte & PTE_PRESENT) ? frame_slot[index] : index;
+    for (int i = 0; i < (1 << pt_bits); i++)
+    {
+        long long v_page = base + ((long long)i << ((level - 1) * pt_bits));
+        if (v_page >= max_pages)
+        {
+            break;
+        }
+        unsigned char *entry = find_pte(pid, v_page, level);
+        pte_t other = entry == NULL ? 0 : get_pte(entry);
+        if (!(other & PTE_VALID) || (other & PTE_HUGE))
+        {
+            continue;
+        }
+
+        if (level > 1)
+        {
+            if (shm_search(pid, level - 1, v_page, pte, found_pid, found_vpage))
+            {
+                return 1;
+            }
+        }
+        else if (other & PTE_SHARED)
+        {
+            // The same physical page, or the same swap slot whether it is on disk or still backs a physical page
+            int other_index = other >> PTE_FRAME_SHIFT;
+            int other_slot = (other & PTE_PRESENT) ? frame_slot[other_index] : other_index;
+            if (((other & pte & PTE_PRESENT) && other_index == index) || (slot != -1 && other_slot == slot))
+            {
+                *found_pid = pid;
+                *found_vpage = v_page;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Returns the last virtual page of the len bytes from v_addr, or the page of v_addr if len is 0
+// Returns -1 after reporting it if the range goes past the end of the address space
+long long range_last(long long v_addr, int len)
+{
+    long long last = find_page(v_addr + (len > 0 ? len - 1 : 0));
+    if (last >= max_pages)
+    {
+        LOG(LOG_EVENTS, "ERROR: %d bytes from virtual address %lld go past the end of the address space\n", len, v_addr);
+        return -1;
+    }
+    return last;
+}
+
+// Unmaps every virtual page of the len bytes from v_addr, or the page of v_addr if len is 0, pages that are not mapped are skipped
+// Entries are cleared where their tables are, even on disk, and the translations are dropped from the TLB once for the whole range
+int unmap_range(int pid, long long v_addr, int len)
+{
+    long long first = find_page(v_addr);
+    long long last = range_last(v_addr, len);
+    long long pages = unmapped_pages;
+    long long frames = freed_frames;
+    long long slots = freed_slots;
+    int run = 1 << pt_bits;
+    if (last == -1)
+    {
+        return 0;
+    }
+
+    long long v_page = first;
+    while (v_page <= last)
+    {
+        long long next = v_page + 1;
+        unsigned char *large = pt_levels >= 2 ? find_pte(pid, v_page, 2) : NULL;
+        unsigned char *entry = NULL;
+        if (large != NULL && (get_pte(large) & PTE_HUGE))
+        {
+            long long start = v_page & ~(long long)(run - 1);
+            next = start + run;
+            if (start < first || next - 1 > last)
+            {
+                LOG(LOG_EVENTS, "ERROR: Virtual pages %lld to %lld are a large page, it can only be unmapped whole\n", start, next - 1);
+            }
+            else
+            {
+                unmap_large(pid, start, large);
+            }
+        }
+        else if ((entry = find_pte(pid, v_page, 1)) == NULL)
+        {
+            next = (v_page | (run - 1)) + 1; // No level 1 table, so nothing is mapped up to the next one
+        }
+        else if (get_pte(entry) & PTE_VALID)
+        {
+            unmap_page(pid, v_page, entry);
+        }
+        v_page = next;
+    }
+    if (unmapped_pages > pages)
+    {
+        tlb_invalidate_range(pid, first, last - first + 1);
+    }
+
+    LOG(LOG_EVENTS, "Unmapped %lld pages from virtual address %lld, freeing %lld physical frames and %lld swap slots\n", unmapped_pages - pages, v_addr, freed_frames - frames, freed_slots - slots);
+    return 0;
+}
+
+// Clears the entry of a data page, its physical page and swap slot are freed unless another process still maps them
+void unmap_page(int pid, long long v_page, unsigned char *entry)
+{
+    pte_t pte = get_pte(entry);
+    int index = pte >> PTE_FRAME_SHIFT;
+    set_pte(entry, 0);
+    unmapped_pages++;
+    if (pte & PTE_SHARED)
+    {
+        shm_release(pid, v_page, pte);
+    }
+
+    if (pte & PTE_PRESENT)
+    {
+        int slot = frame_slot[index];
+
+        // Stores to shared memory are only in this entry's dirty bit, other mappings would later read the stale swap slot
+        if ((pte & PTE_SHARED) && (pte & PTE_DIRTY) && slot != -1 && (frame_refs[index] > 1 || slot_refs[slot] > 1))
+        {
+            char *page = (char *)&memory[find_address(index)];
+            if (zswap_limit == 0 || zswap_store(slot, page) == -1)
+            {
+                disk_write(slot, page);
+            }
+        }
+        if (frame_refs[index] > 1)
+        {
+            share_remove(index, pid, v_page);
+        }
+        else
+        {
+            free_list[index] = -1;
+            frame_slot[index] = -1;
+            rmap[index].pid = -1;
+            frame_prefetched[index] = 0;
+            free_frames++;
+            freed_frames++;
+            rss_add(pid, -1);
+        }
+        if (slot != -1)
+        {
+            slot_release(slot);
+        }
+        LOG_EVENT("unmap", pid, v_page, index, slot, NULL);
+    }
+    else if (!pte_zero(pte))
+    {
+        slot_release(index);
+        LOG_EVENT("unmap", pid, v_page, -1, index, NULL);
+    }
+    else
+    {
+        LOG_EVENT("unmap", pid, v_page, -1, -1, NULL);
+    }
+}
+
+// Clears the level 2 entry of a large page and frees its physical pages, which no other process maps
+void unmap_large(int pid, long long v_page, unsigned char *entry)
+{
+    int run = 1 << pt_bits;
+    int p_page = get_pte(entry) >> PTE_FRAME_SHIFT;
+    set_pte(entry, 0);
+    for (int i = p_page; i < p_page + run; i++)
+    {
+        free_list[i] = -1;
+        frame_slot[i] = -1;
+        frame_huge[i] = 0;
+        rmap[i].pid = -1;
+        free_frames++;
+    }
+    rss_add(pid, -run);
+    large_pages--;
+    unmapped_pages += run;
+    freed_frames += run;
+    LOG_EVENT("unmap", pid, v_page, p_page, -1, NULL);
+}
+
+// Makes every mapped virtual page of the len bytes from v_addr read only (r_value 0) or read and write (r_value 1), like map does for one page
+// Entries are changed where their tables are, even on disk, and the translations are dropped from the TLB once for the whole range
+int protect_range(int pid, long long v_addr, int r_value, int len)
+{
+    long long first = find_page(v_addr);
+    long long last = range_last(v_addr, len);
+    long long changed = 0;
+    int run = 1 << pt_bits;
+    if (last == -1)
+    {
+        return 0;
+    }
+
+    long long v_page = first;
+    while (v_page <= last)
+    {
+        long long next = v_page + 1;
+        pte_t rw_bit = (r_value & 1) ? PTE_WRITE : 0;
+        unsigned char *large = pt_levels >= 2 ? find_pte(pid, v_page, 2) : NULL;
+        unsigned char *entry = NULL;
+        if (large != NULL && (get_pte(large) & PTE_HUGE))
+        {
+            long long start = v_page & ~(long long)(run - 1);
+            next = start + run;
+            if (start < first || next - 1 > last)
+            {
+                LOG(LOG_EVENTS, "ERROR: Virtual pages %lld to %lld are a large page, its permissions can only be changed whole\n", start, next - 1);
+            }
+            else
+            {
+                set_pte(large, (get_pte(large) & ~PTE_WRITE) | rw_bit);
+                changed += run;
+                LOG_EVENT("protect", pid, start, get_pte(large) >> PTE_FRAME_SHIFT, -1, NULL);
+            }
+        }
+        else if ((entry = find_pte(pid, v_page, 1)) == NULL)
+        {
+            next = (v_page | (run - 1)) + 1; // No level 1 table, so nothing is mapped up to the next one
+        }
+        else if (get_pte(entry) & PTE_VALID)
+        {
+            pte_t pte = get_pte(entry);
+            if (rw_bit && !(pte & PTE_SHARED) && page_shared(pte))
+            {
+                rw_bit = PTE_COW; // Writable, but the first store copies the page
+            }
+            set_pte(entry, (pte & ~(PTE_WRITE | PTE_COW)) | rw_bit);
+            changed++;
+            LOG_EVENT("protect", pid, v_page, pte & PTE_PRESENT ? (int)(pte >> PTE_FRAME_SHIFT) : -1, -1, NULL);
+        }
+        v_page = next;
+    }
+    if (changed > 0)
+    {
+        tlb_invalidate_range(pid, first, last - first + 1);
+    }
+
+    LOG(LOG_EVENTS, "Made %lld pages from virtual address %lld %s\n", changed, v_addr, (r_value & 1) ? "read and write" : "read only");
+    return 0;
+}
+
+// Translates a virtual address for a load or store of width bytes, bringing the page and its tables into memory
+// Returns the physical address, ZERO_ADDR for a load from a page that is still the zero page, or -1 if the access is not allowed
+int access_page(int pid, long long v_addr, int width, int write)
+{
+    long long v_page = find_page(v_addr);
+    int phys_addr;
+    int pte_addr = -1;
+
+    // Only already dirty pages hit for writes, so a page's dirty bit always reaches its PTE
+    int tlb_page = tlb_lookup(pid, v_page, write ? PTE_WRITE | PTE_DIRTY : 0);
+    if (tlb_page != -1)
+    {
+        phys_addr = find_address(tlb_page) + (v_addr & (page_size - 1));
+        pid_stats[pid].hits++;
+    }
+    else
+    {
+        lat_cost += lat_walk * pt_levels; // Faults and disk I/O on the way charge their own time
+        pte_addr = walk(pid, v_page, 0);
+        pte_t pte = pte_addr == -1 ? 0 : get_pte(&memory[pte_addr]);
+        if (write && !(pte & (PTE_WRITE | PTE_COW)))
+        {
+            LOG(LOG_EVENTS, "ERROR: Writes are not allowed to this page\n");
+            if (pte & PTE_VALID)
+            {
+                pid_stats[pid].wp_faults++;
+            }
+            return -1;
+        }
+        if (!(pte & PTE_VALID))
+        {
+            LOG(LOG_EVENTS, "ERROR: Virtual page %lld has not been allocated for process %d!\n", v_page, pid);
+            return -1;
+        }
+        if (pte_zero(pte) && !write)
+        {
+            // Nothing has been stored in the page yet, so it reads as the zero page without taking a physical page
+            set_pte(&memory[pte_addr], pte | PTE_REF);
+            policy_touch(find_page(pte_addr));
+            pid_stats[pid].hits++;
+            pid_stats[pid].accesses++;
+            zero_reads++;
+            return access_fits(v_addr, width, write) ? ZERO_ADDR : -1;
+        }
+        if (pte_zero(pte))
+        {
+            if (replace_page(pid, v_page) == -1) // First store, not a miss for the prefetcher
+            {
+                return -1;
+            }
+        }
+        else if (!(pte & PTE_PRESENT))
+        {
+            if (replace_page(pid, v_page) == -1)
+            {
+                return -1;
+            }
+            prefetch_access(pid, v_page, pte_addr, 1);
+        }
+        else
+        {
+            pid_stats[pid].hits++;
+            if (frame_prefetched[pte_frame(pte, v_page)])
+            {
+                prefetch_access(pid, v_page, pte_addr, 0);
+            }
+        }
+        if (write && (pte & PTE_COW))
+        {
+            if (cow_break(pid, v_page, pte_addr) == -1)
+            {
+                return -1;
+            }
+        }
+        phys_addr = translate_ptable(pid, v_addr);
+        if (!write)
+        {
+            pte = get_pte(&memory[pte_addr]) | PTE_REF;
+            set_pte(&memory[pte_addr], pte);
+            tlb_insert(pid, v_page, pte);
+        }
+        policy_touch(find_page(pte_addr));
+    }
+    policy_touch(find_page(phys_addr));
+    pid_stats[pid].accesses++;
+
+    if (!access_fits(v_addr, width, write))
+    {
+        return -1;
+    }
+    if (write && tlb_page == -1)
+    {
+        pte_t pte = get_pte(&memory[pte_addr]) | PTE_DIRTY | PTE_REF;
+        set_pte(&memory[pte_addr], pte);
+        tlb_insert(pid, v_page, pte);
+    }
+    return phys_addr;
+}
+
+// Returns 1 if an access of width bytes at a virtual address stays within its page, otherwise reports it
+int access_fits(long long v_addr, int width, int write)
+{
+    if ((v_addr & (page_size - 1)) + width <= page_size)
+    {
+        return 1;
+    }
+    if (write)
+    {
+        LOG(LOG_EVENTS, "ERROR: Write goes over end of page! Value not stored\n");
+    }
+    else
+    {
+        LOG(LOG_EVENTS, "ERROR: Read goes over end of page! Value not loaded\n");
+    }
+    return 0;
+}
+
+// Runs access_page as one access of the latency model, which costs a TLB lookup plus what the access charges on a miss
+// Accesses that are not allowed cost time but are left out of the latency figures
+int timed_access(int pid, long long v_addr, int width, int write)
+{
+    long long start = lat_cost;
+    lat_cost += lat_tlb;
+    int phys_addr = access_page(pid, v_addr, width, write);
+    if (phys_addr != -1)
+    {
+        long long ns = lat_cost - start;
+        lat[pid].accesses++;
+        lat[pid].access_time += ns;
+        lat[pid].hist[lat_bucket(ns)]++;
+    }
+    return phys_addr;
+}
+
+// Stores the low width bytes of value in physical memory
+int store(int pid, long long v_addr, long long value, int width)
+{
+    int phys_addr = timed_access(pid, v_addr, width, 1);
+    if (phys_addr != -1)
+    {
+        write_value(phys_addr, value, width);
+        LOG_EVENT("store", pid, find_page(v_addr), find_page(phys_addr), -1, "Stored value %lld at virtual address %lld (physical address %d)\n", read_value(phys_addr, width), v_addr, phys_addr);
+    }
+
+    return 0; // Success
+}
+
+// Loads a value of width bytes from physical memory
+int load(int pid, long long v_addr, int width)
+{
+    int phys_addr = timed_access(pid, v_addr, width, 0);
+    if (phys_addr == ZERO_ADDR)
+    {
+        LOG_EVENT("load", pid, find_page(v_addr), -1, -1, "The value 0 is virtual address %lld (zero page)\n", v_addr);
+    }
+    else if (phys_addr != -1)
+    {
+        LOG_EVENT("load", pid, find_page(v_addr), find_page(phys_addr), -1, "The value %lld is virtual address %lld (physical address %d)\n", read_value(phys_addr, width), v_addr, phys_addr);
+    }
+
+    return 0; // Success
+}
+
+// Copies len bytes from virtual address src to dst, one piece per page that either side crosses
+// Overlapping ranges are copied from the end when dst is after src, like memmove
+int block_copy(int pid, long long dst, long long src, int len)
+{
+    long long limit = max_pages * page_size;
+    if (len <= 0 || src < 0 || src > limit - len || dst > limit - len)
+    {
+        LOG(LOG_EVENTS, "ERROR: Cannot copy %d bytes from virtual address %lld to %lld\n", len, src, dst);
+        return 0;
+    }
+
+    int backward = dst > src && dst < src + len;
+    int left = len;
+    while (left > 0)
+    {
+        // Bytes up to the nearest page boundary of either side, before the end when copying backward
+        int src_room = backward ? ((src + left - 1) & (page_size - 1)) + 1 : page_size - ((src + len - left) & (page_size - 1));
+        int dst_room = backward ? ((dst + left - 1) & (page_size - 1)) + 1 : page_size - ((dst + len - left) & (page_size - 1));
+        int chunk = src_room < dst_room ? src_room : dst_room;
+        chunk = chunk < left ? chunk : left;
+        int start = backward ? left - chunk : len - left;
+
+        // The source piece is set aside, so bringing the destination in may evict it
+        int from = timed_access(pid, src + start, chunk, 0);
+        if (from == ZERO_ADDR)
+        {
+            memset(block_page, 0, chunk);
+        }
+        else if (from != -1)
+        {
+            memcpy(block_page, &memory[from], chunk);
+        }
+        unpin_frames();
+        int to = from == -1 ? -1 : timed_access(pid, dst + start, chunk, 1);
+        if (to == -1)
+        {
+            unpin_frames();
+            LOG(LOG_EVENTS, "ERROR: Copy stopped with %d of %d bytes left\n", left, len);
+            return 0;
+        }
+        memcpy(&memory[to], block_page, chunk);
+        unpin_frames(); // Every piece is an access of its own
+        left -= chunk;
+    }
+    LOG_EVENT("copy", pid, find_page(dst), -1, -1, "Copied %d bytes from virtual address %lld to %lld\n", len, src, dst);
+    return 0;
+}
+
+// Sets len bytes from virtual address v_addr to byte, one piece per page
+int block_fill(int pid, long long v_addr, int byte, int len)
+{
+    if (len <= 0 || v_addr > max_pages * page_size - len)
+    {
+        LOG(LOG_EVENTS, "ERROR: Cannot fill %d bytes from virtual address %lld\n", len, v_addr);
+        return 0;
+    }
+
+    int done = 0;
+    while (done < len)
+    {
+        int chunk = page_size - ((v_addr + done) & (page_size - 1));
+        chunk = chunk < len - done ? chunk : len - done;
+        int to = timed_access(pid, v_addr + done, chunk, 1);
+        if (to == -1)
+        {
+            unpin_frames();
+            LOG(LOG_EVENTS, "ERROR: Fill stopped with %d of %d bytes left\n", len - done, len);
+            return 0;
+        }
+        memset(&memory[to], byte, chunk);
+        unpin_frames();
+        done += chunk;
+    }
+    LOG_EVENT("fill", pid, find_page(v_addr), -1, -1, "Filled %d bytes from virtual address %lld with %d\n", len, v_addr, byte & 0xFF);
+    return 0;
+}
+
+// Chooses physical page to evict from memory using the selected replacement policy
+int evict(int pid)
+{
+    int victim = cur_policy->choose(pid);
+    LOG(LOG_DEBUG, "Replacement policy %s chose physical frame %d for PID %d\n", cur_policy->name, victim, pid);
+    return victim;
+}
+
+// Returns 1 if pid may evict the physical page, a process never evicts its own page table or a table the running instruction walked through
+int can_evict(int pid, int page)
+{
+    return free_list[page] != -1 && !frame_huge[page] && find_address(page) != pid_array[pid] && !__atomic_load_n(&frame_pinned[page], __ATOMIC_RELAXED)
+        && (!evict_local || frame_mapped_by(page, pid));
+}
+
+// Adds a process that maps a data page at v_page to the physical page's sharers
+void share_add(int page, int pid, long long v_page)
+{
+    if (sharers_free == -1)
+    {
+        int cap = sharers_cap == 0 ? 64 : sharers_cap * 2;
+        sharer_entry *grown = realloc(sharers, cap * sizeof(sharer_entry));
+        if (grown == NULL)
+        {
+            LOG(LOG_SUMMARY, "ERROR: Cannot allocate %d sharers\n", cap);
+            return;
+        }
+        sharers = grown;
+        for (int i = cap - 1; i >= sharers_cap; i--)
+        {
+            sharers[i].next = sharers_free;
+            sharers_free = i;
+        }
+        sharers_cap = cap;
+    }
+
+    int i = sharers_free;
+    sharers_free = sharers[i].next;
+    sharers[i].pid = pid;
+    sharers[i].v_page = v_page;
+    sharers[i].next = frame_sharers[page];
+    frame_sharers[page] = i;
+    __atomic_add_fetch(&frame_refs[page], 1, __ATOMIC_RELAXED); // Read by other threads' fast paths
+    rss_add(pid, 1);
+}
+
+// Removes a process from the processes mapping a physical page, the first sharer takes over the reverse map entry if it was the owner
+void share_remove(int page, int pid, long long v_page)
+{
+    int *link = &frame_sharers[page];
+    if (rmap[page].pid == pid && rmap[page].v_page == v_page)
+    {
+        if (*link == -1)
+        {
+            return;
+        }
+        rmap[page].pid = sharers[*link].pid;
+        rmap[page].v_page = sharers[*link].v_page;
+    }
+    else
+    {
+        while (*link != -1 && !(sharers[*link].pid == pid && sharers[*link].v_page == v_page))
+        {
+            link = &sharers[*link].next;
+        }
+        if (*link == -1)
+        {
+            return;
+        }
+    }
+
+    int i = *link;
+    *link = sharers[i].next;
+    sharers[i].next = sharers_free;
+    sharers_free = i;
+    __atomic_sub_fetch(&frame_refs[page], 1, __ATOMIC_RELAXED);
+    rss_add(pid, -1);
+}
+
+// Leaves a physical page with only its reverse map entry as owner, for when it is given new contents
+void share_clear(int page)
+{
+    while (frame_sharers[page] != -1)
+    {
+        int i = frame_sharers[page];
+        frame_sharers[page] = sharers[i].next;
+        sharers[i].next = sharers_free;
+        sharers_free = i;
+        rss_add(sharers[i].pid, -1);
+    }
+    __atomic_store_n(&frame_refs[page], 1, __ATOMIC_RELAXED);
+}
+
+// Counts data pages coming into (pages > 0) or leaving a process's resident set
+void rss_add(int pid, int pages)
+{
+    rss[pid].pages += pages;
+    if (rss[pid].pages > rss[pid].peak)
+    {
+        rss[pid].peak = rss[pid].pages;
+    }
+}
+
+// Returns 1 if a process maps a physical data page, as its reverse map owner or as a sharer
+int frame_mapped_by(int page, int pid)
+{
+    if (rmap[page].level != 0 || rmap[page].pid == -1)
+    {
+        return 0;
+    }
+    if (rmap[page].pid == pid)
+    {
+        return 1;
+    }
+    for (int i = frame_sharers[page]; i != -1; i = sharers[i].next)
+    {
+        if (sharers[i].pid == pid)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Runs the replacement policy over a process's own data pages only, for a process at its resident set cap
+// Returns -1 if none of them can be evicted, then the page comes from the whole of memory instead
+int evict_own(int pid)
+{
+    evict_local = 1;
+    int victim = evict(pid);
+    evict_local = 0;
+    return victim;
+}
+
+// Returns 1 if a working set sample is due, read without vm_lock by the worker threads' fast paths
+int ws_due()
+{
+    return ws_interval > 0 && __atomic_load_n(&inst_count, __ATOMIC_RELAXED) >= __atomic_load_n(&ws_next, __ATOMIC_RELAXED);
+}
+
+// Counts every process's pages referenced since the last sample and clears their referenced bits
+// Their TLB entries are dropped as well, so the next access sets the bit again
+void ws_sample()
+{
+    long long now = __atomic_load_n(&inst_count, __ATOMIC_RELAXED);
+    for (int pid = 0; pid < max_proc; pid++)
+    {
+        if (pid_array[pid] == -1 && on_disk[pid] == -1)
+        {
+            continue;
+        }
+
+        // The process's worker thread must not use its tables while their bits are cleared
+        int locked = num_threads > 0 && pid != held_pid;
+        if (locked)
+        {
+            lock_process(pid);
+        }
+        int pages = ws_scan(pid, pt_levels, 0);
+        if (locked)
+        {
+            pthread_mutex_unlock(&proc_lock[pid]);
+        }
+
+        rss[pid].ws_last = pages;
+        rss[pid].ws_total += pages;
+        if (pages > rss[pid].ws_peak)
+        {
+            rss[pid].ws_peak = pages;
+        }
+        LOG(LOG_EVENTS, "Working set of PID %d: %d pages referenced in the last %lld instructions, %d pages in memory\n", pid, pages, now - ws_last_inst, rss[pid].pages);
+    }
+    ws_samples++;
+    ws_last_inst = now;
+    __atomic_store_n(&ws_next, now - now % ws_interval + ws_interval, __ATOMIC_RELAXED);
+}
+
+// Counts and clears the referenced bits of the data pages under pid's page table at level that covers the virtual pages from base
+// Tables on disk are changed in place, like evictions do
+int ws_scan(int pid, int level, long long base)
+{
+    int pages = 0;
+    for (int i = 0; i < (1 << pt_bits); i++)
+    {
+        long long v_page = base + ((long long)i << ((level - 1) * pt_bits));
+        if (v_page >= max_pages)
+        {
+            break;
+        }
+        unsigned char *entry = find_pte(pid, v_page, level);
+        pte_t pte = entry == NULL ? 0 : get_pte(entry);
+        if (!(pte & PTE_VALID))
+        {
+            continue;
+        }
+
+        if (level > 1 && !(pte & PTE_HUGE))
+        {
+            pages += ws_scan(pid, level - 1, v_page);
+        }
+        else if (pte & PTE_REF)
+        {
+            pages += (pte & PTE_HUGE) ? 1 << pt_bits : 1;
+            set_pte(entry, pte & ~PTE_REF);
+            tlb_invalidate(pid, v_page);
+        }
+    }
+    return pages;
+}
+
+// Prints each process's resident set and, if the estimator ran, its working set
+void rss_report()
+{
+    if (rss_cap == 0 && ws_interval == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < max_proc; i++)
+    {
+        rss_state *r = &rss[i];
+        if (r->peak == 0 && r->ws_peak == 0)
+        {
+            continue;
+        }
+        if (ws_samples > 0)
+        {
+            LOG(LOG_SUMMARY, "Resident set of PID %d: %d pages, %d at most, %lld own pages evicted at the cap, working set of %.1f pages on average and %d at most over %lld samples\n",
+                i, r->pages, r->peak, r->cap_evictions, (double)r->ws_total / ws_samples, r->ws_peak, ws_samples);
+        }
+        else
+        {
+            LOG(LOG_SUMMARY, "Resident set of PID %d: %d pages, %d at most, %lld own pages evicted at the cap\n", i, r->pages, r->peak, r->cap_evictions);
+        }
+    }
+}
+
+// Resets replacement state of a physical page that was given new contents
+void policy_load(int page)
+{
+    unsigned int now = __atomic_add_fetch(&access_clock, 1, __ATOMIC_RELAXED);
+    frame_loaded[page] = now;
+    frame_last_use[page] = now;
+    frame_uses[page] = 1;
+    frame_ref[page] = 1;
+}
+
+// Records an access to a physical page
+void policy_touch(int page)
+{
+    frame_last_use[page] = __atomic_add_fetch(&access_clock, 1, __ATOMIC_RELAXED);
+    frame_uses[page]++;
+    frame_ref[page] = 1;
+}
+
+// Round robin, will skip page if it is the process's page table, -1 if a full sweep finds nothing to evict
+int evict_rr(int pid)
+{
+    int cur_evict = last_evict;
+
+    // Skip pid's page tables and pinned pages
+    for (int i = 0; i < num_frames; i++)
+    {
+        cur_evict++;
+        if (cur_evict >= num_frames)
+        {
+            cur_evict = 0;
+        }
+        if (can_evict(pid, cur_evict))
+        {
+            last_evict = cur_evict;
+            return cur_evict;
+        }
+    }
+
+    return -1;
+}
+
+// Evicts the page that has been in memory the longest
+int evict_fifo(int pid)
+{
+    int victim = -1;
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (can_evict(pid, i) && (victim == -1 || frame_loaded[i] < frame_loaded[victim]))
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+// Evicts the least recently used page
+int evict_lru(int pid)
+{
+    int victim = -1;
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (can_evict(pid, i) && (victim == -1 || frame_last_use[i] < frame_last_use[victim]))
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+// Evicts the least frequently used page, ties go to the least recently used
+int evict_lfu(int pid)
+{
+    int victim = -1;
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (can_evict(pid, i) && (victim == -1 || frame_uses[i] < frame_uses[victim]
+            || (frame_uses[i] == frame_uses[victim] && frame_last_use[i] < frame_last_use[victim])))
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+// Sweeps the clock hand, clearing referenced bits until it finds an unreferenced page
+int evict_clock(int pid)
+{
+    for (int i = 0; i < 2 * num_frames + 1; i++)
+    {
+        int cur = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+        if (!can_evict(pid, cur))
+        {
+            continue;
+        }
+        if (frame_ref[cur])
+        {
+            frame_ref[cur] = 0;
+        }
+        else
+        {
+            return cur;
+        }
+    }
+    return evict_fifo(pid); // Only reached if nothing can be evicted
+}
+
+// Takes the oldest page, referenced pages are moved to the back of the queue instead
+int evict_second(int pid)
+{
+    while (1)
+    {
+        int victim = evict_fifo(pid);
+        if (victim == -1 || !frame_ref[victim])
+        {
+            return victim;
+        }
+        frame_ref[victim] = 0;
+        frame_loaded[victim] = ++access_clock;
+    }
+}
+
+// Evicts the oldest page that has not been used within the working set window
+int evict_ws(int pid)
+{
+    int victim = -1;
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (can_evict(pid, i) && access_clock - frame_last_use[i] > ws_window
+            && (victim == -1 || frame_loaded[i] < frame_loaded[victim]))
+        {
+            victim = i;
+        }
+    }
+    if (victim == -1)
+    {
+        victim = evict_lru(pid); // Every page is in a working set
+    }
+    return victim;
+}
+
+// Evicts the page whose next use in the trace is furthest away
+int evict_opt(int pid)
+{
+    int victim = -1;
+    int victim_next = -1;
+    int r_pid;
+    int r_level;
+    long long r_vpage;
+
+    for (int i = 0; i < num_frames; i++)
+    {
+        if (!can_evict(pid, i) || find_owner(i, &r_pid, &r_level, &r_vpage) == -1)
+        {
+            continue;
+        }
+
+        int next = trace_len; // Never used again
+        if (opt_pending != NULL)
+        {
+            int slot = r_level > 0 ? -1 : opt_slot(r_pid, r_vpage, 0);
+            next = r_level > 0 ? opt_pending_pt[r_pid] : slot == -1 ? trace_len : opt_pending[slot];
+        }
+        if (next > victim_next)
+        {
+            victim = i;
+            victim_next = next;
+        }
+    }
+    if (victim == -1)
+    {
+        victim = evict_fifo(pid);
+    }
+    return victim;
+}
+
+// Finds the process, page table level and virtual page that a physical page belongs to in the reverse map
+// r_level is 0 for a data page, page tables set r_vpage to the first virtual page they map, returns -1 if there is no owner
+int find_owner(int page, int *r_pid, int *r_level, long long *r_vpage)
+{
+    if (rmap[page].pid == -1)
+    {
+        return -1;
+    }
+
+    *r_pid = rmap[page].pid;
+    *r_level = rmap[page].level;
+    *r_vpage = rmap[page].v_page;
+    return 0;
+}
+
+// Returns a physical page holding the contents of disk slot lineNum (an empty page if lineNum is -1), -1 if no page is free and none can be evicted
+// Evicts a page to disk if there are no free physical pages, lineNum stays reserved as the page's disk copy
+// The page is recorded in the reverse map as level and v_page of pid, as find_owner reports them
+int claim_frame(int pid, int level, long long v_page, int lineNum)
+{
+    // A process at its resident set cap replaces one of its own pages, even if there are free pages
+    int own = -1;
+    if (level == 0 && rss_cap > 0 && rss[pid].pages >= rss_cap)
+    {
+        own = evict_own(pid);
+    }
+
+    for (int i = 0; i < num_frames && own == -1; i++)
+    {
+        if (free_list[i] == -1)
+        {
+            free_list[i] = 0;
+            free_frames--;
+            int start = find_address(i);
+            frame_slot[i] = -1;
+            if (lineNum != -1 && peekFromDisk((char *)&memory[start], lineNum) != -1) // The frame is free, so the page is read straight into it
+            {
+                frame_slot[i] = lineNum;
+                slot_frame[lineNum] = i;
+                pid_stats[pid].swap_ins++;
+                pid_stats[pid].bytes_from_disk += page_size;
+                frame_stats[i].swap_ins++;
+                LOG_EVENT("swap_in", -1, -1, i, lineNum, "Swapped disk slot %d into frame %d\n", lineNum, i);
+            }
+            else
+            {
+                memset(&memory[start], 0, page_size);
+            }
+            rmap[i].pid = pid;
+            rmap[i].level = level;
+            rmap[i].v_page = v_page;
+            frame_prefetched[i] = 0;
+            policy_load(i);
+            if (level == 0)
+            {
+                rss_add(pid, 1);
+            }
+            return i;
+        }
+    }
+
+    if (own != -1)
+    {
+        rss[pid].cap_evictions++;
+    }
+    int to_evict = evict_page(pid, own, lineNum);
+    if (to_evict == -1)
+    {
+        return -1;
+    }
+    if (lineNum != -1)
+    {
+        slot_frame[lineNum] = to_evict;
+        pid_stats[pid].swap_ins++;
+        pid_stats[pid].bytes_from_disk += page_size;
+        frame_stats[to_evict].swap_ins++;
+    }
+    free_list[to_evict] = 0;
+    rmap[to_evict].pid = pid;
+    rmap[to_evict].level = level;
+    rmap[to_evict].v_page = v_page;
+    frame_prefetched[to_evict] = 0;
+    policy_load(to_evict);
+    if (level == 0)
+    {
+        rss_add(pid, 1);
+    }
+
+    return to_evict;
+}
+
+// Evicts physical page to_evict, or a page chosen by the replacement policy if it is -1, and fills it with disk slot lineNum (an empty page if lineNum is -1)
+// The evicted page's entry, in every process sharing it, is updated to its swap slot, returns the physical page or -1 if no page can be evicted
+int evict_page(int pid, int to_evict, int lineNum)
+{
+    int r_pid = -1;
+    int r_level = 0;
+    long long r_vpage = -1;
+
+    if (to_evict == -1)
+    {
+        to_evict = evict(pid);
+    }
+    if (to_evict == -1)
+    {
+        LOG(LOG_EVENTS, "ERROR: No physical frame can be evicted for PID %d, every frame is pinned or in use by large pages\n", pid);
+        return -1;
+    }
+    if (find_owner(to_evict, &r_pid, &r_level, &r_vpage) == -1)
+    {
+        LOG(LOG_SUMMARY, "ERROR: Physical frame %d has no owner\n", to_evict);
+    }
+
+    // Processes mapping the page, the reverse map's owner first, then the ones it was shared with by a fork
+    int refs = r_pid == -1 ? 0 : frame_refs[to_evict];
+    int owner_pid[refs + 1];
+    long long owner_vpage[refs + 1];
+    owner_pid[0] = r_pid;
+    owner_vpage[0] = r_vpage;
+    int k = 1;
+    for (int i = frame_sharers[to_evict]; i != -1 && k < refs; i = sharers[i].next)
+    {
+        owner_pid[k] = sharers[i].pid;
+        owner_vpage[k++] = sharers[i].v_page;
+    }
+
+    // Another process's pages and tables can only change while its worker thread is not using them
+    // A process mapping the page at several addresses is locked once
+    int lock_owner[refs + 1];
+    for (k = 0; k < refs; k++)
+    {
+        lock_owner[k] = num_threads > 0 && owner_pid[k] != pid && owner_pid[k] != held_pid;
+        for (int j = 0; j < k && lock_owner[k]; j++)
+        {
+            lock_owner[k] = owner_pid[j] != owner_pid[k];
+        }
+        if (lock_owner[k])
+        {
+            lock_process(owner_pid[k]);
+        }
+    }
+
+    // Find the entries pointing at the victim before swapping, their table may be the one being swapped in from lineNum
+    unsigned char *parent[refs + 1];
+    long long parent_disk[refs + 1]; // Offset of the entry in the swap file if its table is on disk
+    for (k = 0; k < refs; k++)
+    {
+        parent[k] = NULL;
+        parent_disk[k] = -1;
+        if (r_level < pt_levels)
+        {
+            parent[k] = find_pte(owner_pid[k], owner_vpage[k], r_level + 1);
+            if (parent[k] >= disk_map && parent[k] < disk_map + (size_t)disk_slots * page_size)
+            {
+                parent_disk[k] = parent[k] - disk_map;
+            }
+        }
+    }
+
+    // Only written data pages need to be written back if they already have a disk copy, page tables always are
+    int dirty = 1;
+    if (refs > 0 && parent[0] != NULL && r_level == 0)
+    {
+        dirty = 0;
+        for (k = 0; k < refs; k++)
+        {
+            dirty |= (get_pte(parent[k]) & PTE_DIRTY) != 0;
+        }
+    }
+    int written = dirty || frame_slot[to_evict] == -1;
+
+    int new_line = swap(to_evict, lineNum, frame_slot[to_evict], dirty);
+    if (frame_slot[to_evict] == -1 && new_line != -1)
+    {
+        slot_refs[new_line] = refs > 0 ? refs : 1;
+    }
+    frame_slot[to_evict] = lineNum;
+    for (k = 0; k < refs; k++)
+    {
+        if (parent_disk[k] == -1)
+        {
+            continue;
+        }
+        if (parent_disk[k] / page_size == lineNum)
+        {
+            parent[k] = &memory[find_address(to_evict) + parent_disk[k] % page_size]; // The table was just swapped into this frame
+        }
+        else
+        {
+            parent[k] = &disk_map[parent_disk[k]]; // The swap file may have been remapped
+        }
+    }
+
+    if (r_pid != -1 && r_level == pt_levels)
+    {
+        LOG_EVENT("ptable_out", r_pid, -1, to_evict, new_line, "Put page table for PID %d into swap slot %d\n", r_pid, new_line);
+        on_disk[r_pid] = new_line;
+        pid_array[r_pid] = -1;
+    }
+    else if (r_pid != -1)
+    {
+        // The parent entries keep the swap slot while the page is not present, they are patched in place if the parent is on disk
+        for (k = 0; k < refs; k++)
+        {
+            set_pte(parent[k], (get_pte(parent[k]) & PTE_FLAGS & ~PTE_PRESENT) | ((pte_t)new_line << PTE_FRAME_SHIFT));
+            if (r_level == 0)
+            {
+                tlb_invalidate(owner_pid[k], owner_vpage[k]);
+            }
+        }
+        if (r_level > 0)
+        {
+            LOG_EVENT("ptable_out", r_pid, -1, to_evict, new_line, "Put level %d page table for PID %d into swap slot %d\n", r_level, r_pid, new_line);
+        }
+    }
+    LOG_EVENT("evict", r_pid, r_level > 0 ? -1 : r_vpage, to_evict, new_line, NULL);
+    if (r_pid != -1)
+    {
+        pid_stats[r_pid].swap_outs += written;
+        pid_stats[r_pid].clean_evictions += !written;
+        pid_stats[r_pid].bytes_to_disk += written * page_size;
+        pid_stats[r_pid].ptable_evictions += r_level > 0;
+    }
+    frame_stats[to_evict].swap_outs += written;
+    frame_stats[to_evict].clean_evictions += !written;
+    frame_stats[to_evict].ptable_evictions += r_level > 0;
+    if (r_pid != -1 && r_level == 0)
+    {
+        rss_add(r_pid, -1);
+    }
+    share_clear(to_evict);
+    for (k = 0; k < refs; k++)
+    {
+        if (lock_owner[k])
+        {
+            pthread_mutex_unlock(&proc_lock[owner_pid[k]]);
+        }
+    }
+
+    return to_evict;
+}
+
+// Evicts pages ahead of demand until free_target physical pages are free, their write-backs overlap with later instructions
+void refill_free_pool(int pid)
+{
+    if (pid < 0 || pid >= max_proc)
+    {
+        return;
+    }
+
+    lat_async = 1; // Refills run ahead of demand, nothing waits for their writes
+    while (free_frames < free_target)
+    {
+        int page = evict_page(pid, -1, -1);
+        if (page == -1)
+        {
+            break;
+        }
+        free_list[page] = -1;
+        frame_slot[page] = -1;
+        rmap[page].pid = -1;
+        free_frames++;
+        LOG_EVENT("reclaim", -1, -1, page, -1, "Reclaimed frame %d for the free pool\n", page);
+    }
+    lat_async = 0;
+}
+
+// Changes mapping of virtual page in a page table when swapping in from disk
+int remap(int pid, long long v_page, int p_page)
+{
+    int entry = walk(pid, v_page, 0);
+    pte_t pte = get_pte(&memory[entry]) & PTE_FLAGS & ~PTE_DIRTY;
+    set_pte(&memory[entry], ((pte_t)p_page << PTE_FRAME_SHIFT) | pte | PTE_PRESENT);
+    tlb_invalidate(pid, v_page);
+
+    LOG_EVENT("remap", pid, v_page, p_page, -1, "Remapped virtual page %lld into physical frame %d\n", v_page, p_page);
+
+    return 0; //Success
+}
+
+// Swaps page, handles array data for disk location, returns -1 if there is no physical page for it
+// A slot shared after a fork is mapped to the physical page another process already swapped it into, if that page still holds it
+int replace_page(int pid, long long v_page)
+{
+    int disk_loc = get_pte(&memory[walk(pid, v_page, 0)]) >> PTE_FRAME_SHIFT; // Non-present entries hold the page's swap slot
+    if (disk_loc == ZERO_SLOT)
+    {
+        int p_page = claim_frame(pid, 0, v_page, -1);
+        if (p_page == -1)
+        {
+            return -1;
+        }
+        count_fault(pid, 0);
+        zero_fills++;
+        LOG_EVENT("zero", pid, v_page, p_page, -1, "Gave virtual page %lld physical frame %d for its first store\n", v_page, p_page);
+        remap(pid, v_page, p_page);
+        return 0;
+    }
+    int cached = slot_refs[disk_loc] > 1 ? slot_frame[disk_loc] : -1;
+    if (cached != -1 && free_list[cached] != -1 && frame_slot[cached] == disk_loc && rmap[cached].level == 0)
+    {
+        share_add(cached, pid, v_page);
+        count_fault(pid, 0);
+        LOG_EVENT("share", pid, v_page, cached, disk_loc, "Shared physical frame %d, which already holds swap slot %d\n", cached, disk_loc);
+        remap(pid, v_page, cached);
+        return 0;
+    }
+
+    int p_page = claim_frame(pid, 0, v_page, disk_loc);
+    if (p_page == -1)
+    {
+        return -1;
+    }
+    count_fault(pid, 1);
+
+    remap(pid, v_page, p_page); // Remaps swapped in page to a physical page
+
+    return 0; // Success
+}
+
+// Swaps page from physical memory and disk, returns lineNum page was put in disk
+// slot is the page's existing disk copy or -1, a page that is not dirty is dropped instead of written to its copy
+int swap(int page, int lineNum, int slot, int dirty)
+{
+    int start = find_address(page);
+    char *putTemp = (char *)&memory[start]; // Unchanged until the new page is copied in
+    char *getTemp = swap_page;
+    int replaceMem = -1;
+    int putLine = slot;
+
+    if(lineNum != -1) // If lineNum is -1, don't try to get something from disk
+    	replaceMem = peekFromDisk(getTemp, lineNum); // The slot stays reserved as the new page's disk copy
+    if (slot == -1)
+    {
+        putLine = disk_alloc();
+    }
+    int pooled = -1; // Compressed size if the page went into the swap pool
+    if (putLine != -1 && (slot == -1 || dirty))
+    {
+        // Page tables are changed in place in the swap file, so only data pages go into the pool
+        if (zswap_limit > 0 && rmap[page].level == 0)
+        {
+            pooled = zswap_store(putLine, putTemp);
+        }
+        if (pooled == -1)
+        {
+            disk_write(putLine, putTemp); // Over the stale copy if the page had one
+        }
+    }
+
+    if(putLine == -1)
+    {
+        LOG(LOG_SUMMARY, "ERROR: Could not put page to disk.\n");
+        return -1;
+    }
+    else if(replaceMem != -1)
+    {
+        for(int i = 0; i < page_size; i++)
+        {
+            memory[start + i] = getTemp[i];
+        }
+    }
+    else // Cannot swap in new memory after putting old in disk, replace memory with empty page
+    {
+        memset(&memory[start], 0, page_size);
+    }
+    if (slot != -1 && !dirty)
+    {
+        LOG_EVENT("drop", -1, -1, page, putLine, "Dropped clean frame %d, its copy is in swap slot %d\n", page, putLine);
+    }
+    else if (pooled != -1)
+    {
+        LOG_EVENT("compress", -1, -1, page, putLine, "Compressed frame %d into the swap pool as swap slot %d (%d bytes)\n", page, putLine, pooled);
+    }
+    else
+    {
+        LOG_EVENT("swap_out", -1, -1, page, putLine, "Swapped frame %d to disk at swap slot %d\n", page, putLine);
+    }
+    if (lineNum != -1)
+    {
+        LOG_EVENT("swap_in", -1, -1, page, lineNum, "Swapped disk slot %d into frame %d\n", lineNum, page);
+    }
+    return putLine;
+}
+
+// Creates an empty swap file and maps it into memory
+int disk_init()
+{
+    disk_fd = open(DISK_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (disk_fd == -1)
+    {
+        printf("ERROR: Cannot open disk %s\n", DISK_FILE);
+        return -1;
+    }
+
+    disk_slots = 0;
+    disk_map = NULL;
+    disk_used = NULL;
+    if (wb_depth > 0 && wb_start() == -1)
+    {
+        return -1;
+    }
+    return disk_grow();
+}
+
+// Doubles the number of swap slots, remapping the swap file
+int disk_grow()
+{
+    int new_slots = disk_slots == 0 ? DISK_SLOTS : disk_slots * 2;
+    if (new_slots > ZERO_SLOT)
+    {
+        printf("ERROR: Cannot grow disk past %d slots\n", disk_slots);
+        return -1;
+    }
+    size_t old_size = (size_t)disk_slots * page_size;
+    size_t new_size = (size_t)new_slots * page_size;
+
+    if (ftruncate(disk_fd, new_size) == -1)
+    {
+        printf("ERROR: Cannot grow disk to %d slots\n", new_slots);
+        return -1;
+    }
+    if (disk_map != NULL)
+    {
+        munmap(disk_map, old_size);
+    }
+    disk_map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (disk_map == MAP_FAILED)
+    {
+        printf("ERROR: Cannot map disk into memory\n");
+        disk_map = NULL;
+        return -1;
+    }
+
+    uint64_t *new_used = realloc(disk_used, new_slots / 64 * sizeof(uint64_t));
+    if (new_used == NULL)
+    {
+        printf("ERROR: Cannot allocate disk bitmap\n");
+        return -1;
+    }
+    memset(&new_used[disk_slots / 64], 0, (new_slots - disk_slots) / 64 * sizeof(uint64_t));
+    disk_used = new_used;
+
+    int *new_refs = realloc(slot_refs, new_slots * sizeof(int));
+    if (new_refs != NULL)
+    {
+        slot_refs = new_refs;
+    }
+    int *new_frame = realloc(slot_frame, new_slots * sizeof(int));
+    if (new_frame != NULL)
+    {
+        slot_frame = new_frame;
+    }
+    if (new_refs == NULL || new_frame == NULL)
+    {
+        printf("ERROR: Cannot allocate swap slot counters\n");
+        return -1;
+    }
+    for (int i = disk_slots; i < new_slots; i++)
+    {
+        slot_refs[i] = 0;
+        slot_frame[i] = -1;
+    }
+
+    if (zswap_limit > 0)
+    {
+        zswap_entry *new_zswap = realloc(zswap, new_slots * sizeof(zswap_entry));
+        if (new_zswap == NULL)
+        {
+            printf("ERROR: Cannot allocate the swap pool index\n");
+            return -1;
+        }
+        memset(&new_zswap[disk_slots], 0, (new_slots - disk_slots) * sizeof(zswap_entry));
+        zswap = new_zswap;
+    }
+    disk_slots = new_slots;
+
+    return 0;
+}
+
+// Reserves the lowest free swap slot, growing the swap file if they are all used, returns the slot
+int disk_alloc()
+{
+    int slot = -1;
+
+    while (slot == -1)
+    {
+        for (int w = disk_hint / 64; w < disk_slots / 64; w++)
+        {
+            if (disk_used[w] != UINT64_MAX)
+            {
+                slot = w * 64 + __builtin_ctzll(~disk_used[w]);
+                break;
+            }
+        }
+        if (slot == -1 && disk_grow() == -1)
+        {
+            return -1;
+        }
+    }
+
+    disk_used[slot / 64] |= (uint64_t)1 << (slot % 64);
+    disk_hint = slot + 1;
+
+    return slot;
+}
+
+// Writes page into a swap slot, queued for the writer thread if there is a write-back queue
+void disk_write(int slot, char *page)
+{
+    disk_writes++;
+    if (wb_depth == 0)
+    {
+        lat_disk(lat_swap_out, 0);
+        memcpy(&disk_map[(size_t)slot * page_size], page, page_size);
+        return;
+    }
+
+    // Merges depend on how far the writer thread got, so for the same simulated time every run each write counts as reaching the disk
+    // An eviction only waits for it once the disk is wb_depth writes behind
+    lat_disk(lat_swap_out, wb_depth * lat_swap_out);
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < wb_count; i++)
+    {
+        wb_entry *entry = &wb_queue[(wb_head + i) % wb_depth];
+        if (entry->slot == slot)
+        {
+            memcpy(entry->data, page, page_size); // The older copy was never written
+            wb_merged++;
+            pthread_mutex_unlock(&wb_lock);
+            return;
+        }
+    }
+    if (wb_count == wb_depth)
+    {
+        wb_stalls++;
+    }
+    while (wb_count == wb_depth)
+    {
+        pthread_cond_wait(&wb_cond, &wb_lock);
+    }
+
+    wb_entry *entry = &wb_queue[(wb_head + wb_count) % wb_depth];
+    entry->slot = slot;
+    memcpy(entry->data, page, page_size);
+    wb_count++;
+    pthread_cond_broadcast(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+// Starts the write-back queue and its writer thread
+int wb_start()
+{
+    wb_queue = malloc(wb_depth * sizeof(wb_entry));
+    unsigned char *data = malloc((size_t)(wb_depth + 1) * page_size);
+    if (wb_queue == NULL || data == NULL)
+    {
+        printf("ERROR: Cannot allocate a write-back queue of %d pages\n", wb_depth);
+        return -1;
+    }
+    for (int i = 0; i < wb_depth; i++)
+    {
+        wb_queue[i].slot = -1;
+        wb_queue[i].data = &data[(size_t)i * page_size];
+    }
+    wb_buffer = &data[(size_t)wb_depth * page_size];
+
+    if (pthread_create(&wb_thread, NULL, wb_main, NULL) != 0)
+    {
+        printf("ERROR: Cannot start the write-back thread\n");
+        return -1;
+    }
+    return 0;
+}
 
-// PID array
-int pid_array[MAX_PROC];
+// Writer thread, writes queued pages into the swap file oldest first until wb_close
+void *wb_main(void *arg)
+{
+    (void)arg;
 
-// Free list
-int free_list[MAX_PROC];
+    pthread_mutex_lock(&wb_lock);
+    while (1)
+    {
+        while (wb_count == 0 && !wb_stop)
+        {
+            pthread_cond_wait(&wb_cond, &wb_lock);
+        }
+        if (wb_count == 0)
+        {
+            break; // Stopped and everything is written
+        }
 
-// Permissions
-int write_list[MAX_PROC][MAX_PAGES];
+        wb_entry *entry = &wb_queue[wb_head];
+        int slot = entry->slot;
+        memcpy(wb_buffer, entry->data, page_size);
+        wb_head = (wb_head + 1) % wb_depth;
+        wb_count--;
+        wb_inflight = slot;
+        pthread_mutex_unlock(&wb_lock);
 
-// Existing Pages
-int page_exists[MAX_PROC][MAX_PAGES];
+        // The swap file is also mapped, pwrite goes through the same page cache so the mapping sees the write
+        if (pwrite(disk_fd, wb_buffer, page_size, (off_t)slot * page_size) != page_size)
+        {
+            printf("ERROR: Cannot write swap slot %d\n", slot);
+        }
 
-// Page Location on Disk
-int on_disk[MAX_PROC][MAX_PAGES + 1];
+        pthread_mutex_lock(&wb_lock);
+        wb_inflight = -1;
+        wb_written++;
+        pthread_cond_broadcast(&wb_cond);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
 
-// Disk
-FILE *disk;
+// Reads a page that is still waiting in the write-back queue, returns -1 if the swap file already has it
+int wb_read(int slot, char *pageHolder)
+{
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < wb_count; i++)
+    {
+        wb_entry *entry = &wb_queue[(wb_head + i) % wb_depth];
+        if (entry->slot == slot)
+        {
+            memcpy(pageHolder, entry->data, page_size);
+            pthread_mutex_unlock(&wb_lock);
+            return 0;
+        }
+    }
+    while (wb_inflight == slot)
+    {
+        pthread_cond_wait(&wb_cond, &wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return -1;
+}
 
-// Round Robin Eviction
-int last_evict = 0;
+// Waits until no write to a slot is queued or being written, so the slot can be used in place in the mapped swap file
+void wb_wait(int slot)
+{
+    if (wb_depth == 0)
+    {
+        return;
+    }
 
-// Function Declarations
-int find_page(int addr); // Returns a corresponding page based on an address
-int find_address(int page); // Returns address of the start of a given page
-int write_mem(int start, char* value); // Writes integer into memory, start is the physical address we want to write to
-int read_mem(int start); // Reads integer from memory
-int translate_ptable(int pid, int v_addr); // Translate page table, return physical address from virtual address
-int create_ptable(int pid); // Allocates page table entry into virtual page
-int map(int pid, int v_addr, int r_value); // Maps virtual page to physical page
-int store(int pid, int v_addr, int value); // Stores value in physical memory
-int load(int pid, int v_addr); // Loads value from physical memory
-int evict(int pid); // Returns physical page that is to be evicted
-int remap(int pid, int v_page, int p_page); //Remaps virtual page if pulled from disk
-int replace_page(int pid, int v_page); // Handles page replacements
-int swap(int page, int lineNum); // Swaps page from physical memory and disk, returns lineNum page was put in disk
-int putToDisk(char page[16]); // Puts page in disk
-int getFromDisk(char (*pageHolder)[16], int lineNum); // Gets page from disk
+    pthread_mutex_lock(&wb_lock);
+    int pending = 1;
+    while (pending)
+    {
+        pending = wb_inflight == slot;
+        for (int i = 0; i < wb_count && !pending; i++)
+        {
+            pending = wb_queue[(wb_head + i) % wb_depth].slot == slot;
+        }
+        if (pending)
+        {
+            pthread_cond_wait(&wb_cond, &wb_lock);
+        }
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
 
-void logMem(); // DEBUGGING ONLY; DISPLAYS PHYSICAL MEMORY
-void logMem()
+// Writes out the write-back queue and stops the writer thread
+void wb_close()
 {
-    for(int i = 0; i < 64; i++)
+    if (wb_depth == 0 || wb_stop)
     {
-        printf("INDEX %d IN MEMORY IS: [%c]\n", i, memory[i]);
+        return;
     }
+
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_broadcast(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(wb_thread, NULL);
 }
 
-// Returns a corresponding page based on an address
-int find_page(int addr)
+// Reads page from disk without freeing its slot
+int peekFromDisk(char *pageHolder, int lineNum)
 {
-    if (addr >= 0 && addr < 16)
+    if (lineNum < 0 || lineNum >= disk_slots || !(disk_used[lineNum / 64] & ((uint64_t)1 << (lineNum % 64))))
+    {
+        LOG(LOG_SUMMARY, "ERROR: Swap slot %d is empty.\n", lineNum);
+        return -1;
+    }
+    if (zswap_limit > 0 && zswap_load(lineNum, pageHolder) == 0)
     {
         return 0;
     }
-    else if (addr >= 16 && addr < 32)
+    lat_disk(lat_swap_in, 0); // Whether the page is still in the write-back queue depends on the writer thread's timing
+    if (wb_depth > 0 && wb_read(lineNum, pageHolder) == 0)
     {
-        return 1;
+        return 0;
     }
-    else if (addr >= 32 && addr < 48)
+
+    memcpy(pageHolder, &disk_map[(size_t)lineNum * page_size], page_size);
+    disk_reads++;
+    return 0;
+}
+
+// Compresses a page into dst, which holds page_size bytes, returns the compressed size or -1 if it would not be smaller
+// The output is a sequence of literal runs (a byte below 0x80 holding the length - 1, then the bytes)
+// and matches (0x80 | length - 3, then the 2-byte distance back to an earlier copy, which may overlap the match)
+int zs_compress(unsigned char *src, unsigned char *dst)
+{
+    int last_seen[1 << ZSWAP_HASH_BITS];
+    for (int i = 0; i < (1 << ZSWAP_HASH_BITS); i++)
     {
-        return 2;
+        last_seen[i] = -1;
     }
-    else if(addr >= 48 && addr < 64)
+
+    int out = 0;
+    int literal = 0; // Start of the bytes not yet written
+    int pos = 0;
+    while (pos <= page_size)
     {
-        return 3;
+        int len = 0;
+        int dist = 0;
+        if (pos + 3 <= page_size)
+        {
+            unsigned int hash = ((src[pos] << 16 | src[pos + 1] << 8 | src[pos + 2]) * 2654435761u) >> (32 - ZSWAP_HASH_BITS);
+            int cand = last_seen[hash];
+            last_seen[hash] = pos;
+            if (cand != -1 && pos - cand <= 0xFFFF)
+            {
+                while (pos + len < page_size && len < 0x7F + 3 && src[cand + len] == src[pos + len])
+                {
+                    len++;
+                }
+                dist = pos - cand;
+            }
+            if (len < 3)
+            {
+                pos++;
+                continue;
+            }
+        }
+
+        // Write the literals before the match, or the rest of the page
+        int end = pos < page_size ? pos : page_size;
+        while (literal < end)
+        {
+            int run = end - literal < 0x80 ? end - literal : 0x80;
+            if (out + 1 + run >= page_size)
+            {
+                return -1;
+            }
+            dst[out++] = run - 1;
+            memcpy(&dst[out], &src[literal], run);
+            out += run;
+            literal += run;
+        }
+        if (pos >= page_size)
+        {
+            break;
+        }
+        if (pos + 3 > page_size)
+        {
+            pos = page_size; // Too short for a match, flush it as literals
+            continue;
+        }
+
+        if (out + 3 >= page_size)
+        {
+            return -1;
+        }
+        dst[out++] = 0x80 | (len - 3);
+        dst[out++] = dist & 0xFF;
+        dst[out++] = dist >> 8;
+        pos += len;
+        literal = pos;
+    }
+    return out;
+}
+
+// Restores a page compressed by zs_compress into dst
+void zs_decompress(unsigned char *src, int len, unsigned char *dst)
+{
+    int in = 0;
+    int out = 0;
+    while (in < len)
+    {
+        int ctrl = src[in++];
+        if (ctrl < 0x80)
+        {
+            memcpy(&dst[out], &src[in], ctrl + 1);
+            in += ctrl + 1;
+            out += ctrl + 1;
+        }
+        else
+        {
+            int dist = src[in] | src[in + 1] << 8;
+            in += 2;
+            for (int i = 0; i < (ctrl & 0x7F) + 3; i++)
+            {
+                dst[out] = dst[out - dist]; // Byte by byte, a match can repeat its own output
+                out++;
+            }
+        }
     }
-else
+}
+
+// Compresses a page into the swap pool as the current copy of a swap slot, writing older pages to the swap file to make room
+// Returns the compressed size, or -1 if the page does not compress or does not fit, in which case it belongs in the swap file
+int zswap_store(int slot, char *page)
 {
-printf("ERROR: Address %d must be in range 0 to 63\n", addr);
+    zswap_drop(slot); // Any older copy is stale
+    int len = zs_compress((unsigned char *)page, zswap_buffer);
+    if (len == -1 || len > zswap_limit)
+    {
+        zswap_rejected++;
+        return -1;
+    }
+
+    while (zswap_used + len > zswap_limit)
+    {
+        zswap_spill();
+    }
+    zswap_entry *entry = &zswap[slot];
+    entry->data = malloc(len);
+    memcpy(entry->data, zswap_buffer, len);
+    entry->len = len;
+    entry->older = zswap_newest;
+    entry->newer = -1;
+    if (zswap_newest != -1)
+    {
+        zswap[zswap_newest].newer = slot;
+    }
+    else
+    {
+        zswap_oldest = slot;
+    }
+    zswap_newest = slot;
+    zswap_used += len;
+    zswap_stored++;
+    zswap_bytes += len;
+    return len;
 }
+
+// Reads a swap slot's page from the swap pool, the pool keeps it as the slot's copy, returns -1 if the slot is not in the pool
+int zswap_load(int slot, char *pageHolder)
+{
+    if (slot >= disk_slots || zswap[slot].data == NULL)
+    {
+        return -1;
+    }
+    zs_decompress(zswap[slot].data, zswap[slot].len, (unsigned char *)pageHolder);
+    zswap_loads++;
+    return 0;
 }
 
-// Returns address of the start of a given page
-int find_address(int page)
+// Removes a swap slot's page from the swap pool if it is there
+void zswap_drop(int slot)
 {
-    if (page == 0)
+    zswap_entry *entry = &zswap[slot];
+    if (entry->data == NULL)
     {
-        return 0;
+        return;
+    }
+
+    if (entry->older != -1)
+    {
+        zswap[entry->older].newer = entry->newer;
     }
-    else if (page == 1)
+    else
     {
-        return 16;
+        zswap_oldest = entry->newer;
     }
-    else if (page == 2)
+    if (entry->newer != -1)
     {
-        return 32;
+        zswap[entry->newer].older = entry->older;
     }
-    else if(page == 3)
+    else
     {
-        return 48;
+        zswap_newest = entry->older;
     }
-else
+    zswap_used -= entry->len;
+    free(entry->data);
+    entry->data = NULL;
+}
+
+// Writes the page that went into the swap pool longest ago to the swap file
+void zswap_spill()
 {
-printf("ERROR: Page %d must be in range 0 to 3\n", page);
+    int slot = zswap_oldest;
+    zs_decompress(zswap[slot].data, zswap[slot].len, (unsigned char *)zswap_page);
+    zswap_drop(slot);
+    disk_write(slot, zswap_page);
+    zswap_spilled++;
+    LOG_EVENT("spill", -1, -1, -1, slot, "Wrote swap slot %d from the swap pool to disk\n", slot);
 }
+
+// Prints what the swap pool held and how many page writes to the swap file it saved
+void zswap_report()
+{
+    if (zswap_limit == 0)
+    {
+        return;
+    }
+
+    LOG(LOG_SUMMARY, "Swap pool: %lld pages compressed to %.1f%% of their size, %lld did not compress, %lld swap-ins from the pool, %lld pages written to disk to make room, %lld of %lld bytes used\n",
+        zswap_stored, zswap_stored > 0 ? 100.0 * zswap_bytes / (zswap_stored * page_size) : 0.0, zswap_rejected, zswap_loads, zswap_spilled, zswap_used, zswap_limit);
+    LOG(LOG_SUMMARY, "Swap file: %lld page writes, %lld page reads, %lld page writes saved by the swap pool\n", disk_writes, disk_reads, zswap_stored - zswap_spilled);
 }
 
-// Writes integer into memory, start is the physical address we want to write to
-int write_mem(int start, char* value)
+// Drops one mapping's reference to a swap slot, the slot is freed once no mapping refers to it
+void slot_release(int slot)
 {
-    int num_bytes = strlen(value);
-    int remainder = start%16;
-    if ((remainder + num_bytes) >= 15)
+    slot_refs[slot]--;
+    if (slot_refs[slot] <= 0)
     {
-        return -1; // Not enough room on the current page
+        disk_free(slot);
     }
+}
 
-    int i;
-    for(i = start; i < 16 + start; i++)
+// Returns a swap slot to the free slots, with any copy of it in the swap pool
+// A write to it still in the write-back queue is harmless, the next write to the slot replaces it in the queue
+void disk_free(int slot)
+{
+    disk_used[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    if (slot < disk_hint)
     {
-        if(value[i - start] != 0)
-            memory[i] = value[i - start];
-        else
-            break;
+        disk_hint = slot;
+    }
+    if (zswap_limit > 0)
+    {
+        zswap_drop(slot);
+    }
+    slot_frame[slot] = -1;
+    slot_refs[slot] = 0;
+    freed_slots++;
+}
+
+
+// Returns instruction type of an instruction name, 0 if unknown
+// Loads and stores are 4 bytes wide, "load1", "store2" and so on give their width in bytes
+int parse_op(char *name, int *width)
+{
+    int size = 0;
+    *width = 4;
+    if ((sscanf(name, "store%d", &size) == 1 || sscanf(name, "load%d", &size) == 1) && (size == 1 || size == 2 || size == 4 || size == 8))
+    {
+        *width = size;
+        return name[0] == 's' ? 2 : 3;
+    }
+    else if (strcmp(name, "map") == 0)
+    {
+        return 1;
+    }
+    else if (strcmp(name, "store") == 0)
+    {
+        return 2;
+    }
+    else if (strcmp(name, "load") == 0)
+    {
+        return 3;
+    }
+    else if (strcmp(name, "stats") == 0)
+    {
+        return 4;
     }
+    else if (strcmp(name, "fork") == 0)
+    {
+        return 5;
+    }
+    else if (strcmp(name, "share") == 0)
+    {
+        return 6;
+    }
+    else if (strcmp(name, "copy") == 0)
+    {
+        return 7;
+    }
+    else if (strcmp(name, "fill") == 0)
+    {
+        return 8;
+    }
+    else if (strcmp(name, "unmap") == 0)
+    {
+        return 9;
+    }
+    else if (strcmp(name, "protect") == 0)
+    {
+        return 10;
+    }
+    return 0;
+}
+
+// Parses a text instruction line into a trace record, returns -1 if it is not a valid instruction
+int parse_record(char *line, trace_record *record)
+{
+    int pid;
+    char name[16];
+    long long v_addr = 0;
+    long long value = 0;
+    int len = 0;
+    int width;
 
-    return (i - start); // Number of bytes written
+    if (sscanf(line, "%d %15s %lld %lld %d", &pid, name, &v_addr, &value, &len) < 2 || pid < 0 || pid > UINT16_MAX || v_addr < 0)
+    {
+        return -1;
+    }
+    record->pid = pid;
+    record->op = parse_op(name, &width);
+    record->width = width;
+    record->len = len;
+    record->value = value;
+    record->v_addr = v_addr;
+    return record->op == 0 ? -1 : 0;
 }
 
-// Reads integer from memory
-int read_mem(int start)
+// Reads all of stdin ahead of time, keeping each line and its parsed record
+int read_text_trace()
 {
-    int read_val;
-    char buffer[4];
-    for(int i = 0; i < 4; i++)
+    char buffer[64];
+    int capacity = 1024;
+    trace_lines = malloc(capacity * sizeof(char *));
+    trace = malloc(capacity * sizeof(trace_record));
+    while (trace_lines != NULL && trace != NULL && fgets(buffer, sizeof(buffer), stdin) != NULL)
     {
-        if(memory[start + i] != '*' && i != 3)
-            buffer[i] = memory[start + i];
-        else
+        if (trace_len == capacity)
         {
-            buffer[i] = '\0';
-            break;
+            capacity *= 2;
+            trace_lines = realloc(trace_lines, capacity * sizeof(char *));
+            trace = realloc(trace, capacity * sizeof(trace_record));
+            if (trace_lines == NULL || trace == NULL)
+            {
+                break;
+            }
+        }
+        if (parse_record(buffer, &trace[trace_len]) == -1)
+        {
+            trace[trace_len].pid = UINT16_MAX; // Invalid line, still echoed and reported when run
         }
+        trace_lines[trace_len++] = strdup(buffer);
     }
-    if(buffer[0] == '\0') return -1;
-    else
+
+    if (trace_lines == NULL || trace == NULL)
     {
-        sscanf(buffer, "%d", &read_val);
-        return read_val;
+        printf("ERROR: Cannot allocate trace\n");
+        return -1;
     }
+    return 0;
 }
 
-// Translate page table, return physical address from virtual address
-// ptable format is an array {0,',',1,1,',',2} -> single digit to immediate left of , is virtual page, single digit to immediate right of , is physical page the vitual page is mapped to.
-// In example, virtual page 0 is mapped to physical page 1 & virtual page 1 is mapped to physical page 2
-int translate_ptable(int pid, int v_addr)
+// Returns slot of a virtual page in OPT's hash table, adding the page if add is set, -1 if it is not there
+int opt_slot(int pid, long long v_page, int add)
 {
-    int start = pid_array[pid];
-    int v_page = find_page(v_addr);
-    int offset = v_page * 16;
-    int phys_addr = -1;
-    int cur_addr = start;
-    for (int i = 0; i < 16; i++) // Only look up to end of page table virtual page
+    long long key = pid * max_pages + v_page;
+    int slot = (int)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> 32) & opt_mask;
+    while (opt_keys[slot] != -1)
     {
-        if (memory[cur_addr] == ',') // PTE Separator
+        if (opt_keys[slot] == key)
         {
-            if(memory[cur_addr - 1] - '0' == find_page(v_addr))
-                return find_address(memory[cur_addr + 1] - '0') + v_addr - offset;
+            return slot;
         }
-        cur_addr++;
+        slot = (slot + 1) & opt_mask;
+    }
+    if (!add)
+    {
+        return -1;
     }
-    return phys_addr; // Return physical address, -1 if address not found
+
+    opt_keys[slot] = key;
+    opt_pending[slot] = trace_len;
+    return slot;
 }
 
-// Allocates page table entry into virtual page
-int create_ptable(int pid)
+// Walks the trace backwards to find the next use of every page, the pending arrays end up holding the first use
+// Pages are hashed because a sparse address space has far more virtual pages than the trace touches
+int opt_prepare()
 {
-    int been_allocated = -1;
-    for(int i = 0; i < 4; i++)
+    int capacity = 1;
+    while (capacity < 2 * (trace_len + 1))
     {
-        if (free_list[i] == -1)
+        capacity *= 2;
+    }
+    opt_mask = capacity - 1;
+
+    opt_next_use = malloc((trace_len + 1) * sizeof(int));
+    opt_next_pid = malloc((trace_len + 1) * sizeof(int));
+    opt_keys = malloc(capacity * sizeof(long long));
+    opt_pending = malloc(capacity * sizeof(int));
+    opt_pending_pt = malloc(max_proc * sizeof(int));
+    if (opt_next_use == NULL || opt_next_pid == NULL || opt_keys == NULL || opt_pending == NULL || opt_pending_pt == NULL)
+    {
+        printf("ERROR: Cannot allocate trace for OPT\n");
+        return -1;
+    }
+
+    for (int i = 0; i < capacity; i++)
+    {
+        opt_keys[i] = -1;
+    }
+    for (int i = 0; i < max_proc; i++)
+    {
+        opt_pending_pt[i] = trace_len;
+    }
+    for (int i = trace_len - 1; i >= 0; i--)
+    {
+        opt_next_use[i] = trace_len;
+        opt_next_pid[i] = trace_len;
+        if (trace[i].pid < max_proc && trace[i].v_addr < (uint64_t)max_pages * page_size)
         {
-            free_list[i] = 0;
-            pid_array[pid] = find_address(i); // Put physical address into pid register
-            been_allocated = 1;
-            printf("Put page table for PID %d into physical frame %d\n", pid, i);
-            break;
+            int slot = opt_slot(trace[i].pid, find_page(trace[i].v_addr), 1);
+            opt_next_use[i] = opt_pending[slot];
+            opt_next_pid[i] = opt_pending_pt[trace[i].pid];
+            opt_pending[slot] = i;
+            opt_pending_pt[trace[i].pid] = i;
         }
     }
 
-    if (been_allocated == -1)
+    return 0;
+}
+
+// Moves OPT's view of the future past a trace record that is about to run
+void opt_advance(int pos)
+{
+    if (opt_pending != NULL && trace[pos].pid < max_proc && trace[pos].v_addr < (uint64_t)max_pages * page_size)
     {
-        replace_page(pid, -1);
-        int p_page = last_evict;
-        pid_array[pid] = find_address(p_page);
-        free_list[p_page] = 0;
-        printf("Put page table for PID %d into physical frame %d\n", pid, p_page);
+        opt_pending[opt_slot(trace[pos].pid, find_page(trace[pos].v_addr), 0)] = opt_next_use[pos];
+        opt_pending_pt[trace[pos].pid] = opt_next_pid[pos];
     }
 }
 
-// Maps virtual page to physical page
-int map(int pid, int v_addr, int r_value)
+// Reads the next instruction line into buffer, returns NULL at the end of input
+char *read_instruction(char *buffer, int size)
 {
-    int page_table = pid_array[pid];
-    int been_allocated = -1;
-    char full_str[16] = "";
-    char buffer[10];
-    char new_entry[10];
+    if (trace_lines == NULL)
+    {
+        return fgets(buffer, size, stdin);
+    }
+    if (trace_pos >= trace_len)
+    {
+        return NULL;
+    }
 
-    int v_page = find_page(v_addr);
-    int p_page;
+    opt_advance(trace_pos);
+    strncpy(buffer, trace_lines[trace_pos], size - 1);
+    buffer[size - 1] = 0;
+    trace_pos++;
+    return buffer;
+}
 
-    // Create page table for process if one does not exist
-    if (page_table == -1 && on_disk[pid][0] == -1)
+// Checks and runs one instruction
+int run_instruction(int pid, int inst_type, long long v_addr, long long input, int width, int len)
+{
+    __atomic_add_fetch(&inst_count, 1, __ATOMIC_RELAXED);
+    lat_cost = 0;
+    if (inst_type == 4)
     {
-        create_ptable(pid);
+        stats_report();
     }
-
-    // Check if entry already exists and update it
-    if (page_exists[pid][v_page] == 1)
+    else if (pid >= max_proc || pid < 0)
     {
-        if (write_list[pid][v_page] == r_value) printf("ERROR: virtual page %d is already mapped with rw_bit=%d\n", v_page, r_value);
-        write_list[pid][v_page] = r_value;
+        LOG(LOG_EVENTS, "ERROR: Process ID %d is invalid! Only ID's 0 to %d are allowed\n", pid, max_proc - 1);
+    }
+    else if (v_addr >= (long long)max_pages * page_size || v_addr < 0)
+    {
+        LOG(LOG_EVENTS, "ERROR: Virtual address %lld is invalid! Only virtual addresses 0 to %lld are allowed\n", v_addr, max_pages * page_size - 1);
+    }
+    else if ((inst_type == 5 || inst_type == 6) && (input < INT_MIN || input > INT_MAX))
+    {
+        LOG(LOG_EVENTS, "ERROR: Value %lld is invalid! Only values %d to %d are allowed\n", input, INT_MIN, INT_MAX);
+    }
+    else if (inst_type == 1)
+    {
+        map(pid, v_addr, input, len);
+    }
+    else if (inst_type == 2)
+    {
+        store(pid, v_addr, input, width);
+    }
+    else if (inst_type == 3)
+    {
+        load(pid, v_addr, width);
+    }
+    else if (inst_type == 5)
+    {
+        fork_process(pid, input);
+    }
+    else if (inst_type == 6)
+    {
+        map_shared(pid, v_addr, input);
+    }
+    else if (inst_type == 7)
+    {
+        block_copy(pid, v_addr, input, len);
+    }
+    else if (inst_type == 8)
+    {
+        block_fill(pid, v_addr, input, len);
+    }
+    else if (inst_type == 9)
+    {
+        unmap_range(pid, v_addr, len);
+    }
+    else if (inst_type == 10)
+    {
+        protect_range(pid, v_addr, input, len);
     }
-
-    // Create new entry
     else
     {
-        for(int i = 0; i < 4; i++)
+        LOG(LOG_EVENTS, "ERROR: Unknown instruction! Use map, store, load, stats, fork, share, copy, fill, unmap or protect\n");
+        return -1;
+    }
+    unpin_frames();
+    if (num_threads == 0)
+    {
+        refill_free_pool(pid);
+        if (ws_due())
         {
-            if (free_list[i] == -1)
-            {
-                free_list[i] = 0;
-                write_list[pid][v_page] = r_value; // Set permissions
-                page_exists[pid][v_page] = 1; // Set existence of page
-                been_allocated = 1;
-                p_page = i;
+            ws_sample();
+        }
+    }
+    if (inst_type != 4 && pid >= 0 && pid < max_proc)
+    {
+        lat[pid].time += lat_cost; // With worker threads the clock adds up instructions as if they ran one after another
+        __atomic_add_fetch(&sim_time, lat_cost, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
 
-                int write_addr = pid_array[pid];
-                for(int j = 0; j < 16; j++)
-                {
-                    if (memory[write_addr] == '*') // Write entry to ptable
-                    {
-                        sprintf(buffer, "%d", v_page);
-                        strcat(full_str, buffer);
-                        strcat(full_str, ",");
-                        sprintf(buffer, "%d", p_page);
-                        strcat(full_str, buffer);
-                        write_addr += write_mem(write_addr, full_str);
-                        break;
-                    }
-                    write_addr++;
-                }
+// Returns 1 if a load or store can run without faulting, the page and every table above it are in memory
+int is_resident(int pid, long long v_addr)
+{
+    if (pid < 0 || pid >= max_proc || v_addr < 0 || v_addr >= max_pages * page_size || pid_array[pid] == -1)
+    {
+        return 0;
+    }
 
-                printf("Mapped virtual address %d (page %d) into physical frame %d\n", v_addr, v_page, p_page);
-                break;
-            }
+    long long v_page = find_page(v_addr);
+    int table = pid_array[pid];
+    for (int level = pt_levels; level >= 1; level--)
+    {
+        pte_t pte = get_pte(&memory[table + pt_index(v_page, level) * PTE_SIZE]);
+        if (!(pte & PTE_VALID) || !(pte & PTE_PRESENT))
+        {
+            return 0;
         }
-        if (been_allocated == -1)
+        if (pte & PTE_HUGE)
         {
-            replace_page(pid, -1);
-            write_list[pid][v_page] = r_value; // Set permissions
-            page_exists[pid][v_page] = 1; // Set existence of page
-            been_allocated = 1;
-            p_page = last_evict;
-            free_list[p_page] = 0;
-
-            int write_addr = pid_array[pid];
-            //printf("page table address: %d, physical frame to map to: %d\n", write_addr, p_page);
-            for(int j = 0; j < 16; j++)
-            {
-                if (memory[write_addr] == '*') // Write entry to ptable
-                {
-                    sprintf(buffer, "%d", v_page);
-                    strcat(full_str, buffer);
-                    strcat(full_str, ",");
-                    sprintf(buffer, "%d", p_page);
-                    strcat(full_str, buffer);
-                    write_addr += write_mem(write_addr, full_str);
-                    break;
-                }
-                write_addr++;
-            }
-
-            printf("Mapped virtual address %d (page %d) into physical frame %d\n", v_addr, v_page, p_page);
+            return 1; // Large pages are never swapped out or prefetched
+        }
+        if (level == 1 && frame_prefetched[pte >> PTE_FRAME_SHIFT])
+        {
+            return 0; // The first use of a prefetched page can prefetch more
+        }
+        if (level == 1 && (pte & PTE_COW))
+        {
+            return 0; // A store may have to copy the page
+        }
+        if (level == 1 && ((pte & PTE_SHARED) || __atomic_load_n(&frame_refs[pte >> PTE_FRAME_SHIFT], __ATOMIC_RELAXED) > 1))
+        {
+            return 0; // Other processes' threads use the page too
         }
+        table = find_address(pte >> PTE_FRAME_SHIFT);
     }
+    return 1;
+}
 
-    return 0; // Success
+// Takes the lock of a process other than the running one, only ever while holding vm_lock
+// Its holder is a load or store on the fast path, which waits for no other lock, so polling cannot deadlock and never orders two process locks
+void lock_process(int pid)
+{
+    while (pthread_mutex_trylock(&proc_lock[pid]) != 0)
+    {
+        sched_yield();
+    }
 }
 
-// Stores value in physical memory
-int store(int pid, int v_addr, int value)
+// Runs one instruction from a worker thread
+// Loads and stores of pages in memory only hold their process's lock, so processes run in parallel until they fault
+void run_threaded(int pid, int inst_type, long long v_addr, long long input, int width, int len)
 {
-    if (on_disk[pid][0] != -1 || pid_array[pid] == -1)
+    if (pid < 0 || pid >= max_proc)
     {
-        int to_evict = evict(pid);
-        swap(to_evict, on_disk[pid][0]);
-        on_disk[pid][0] = -1;
-        pid_array[pid] = find_address(last_evict);
+        pthread_mutex_lock(&vm_lock);
+        run_instruction(pid, inst_type, v_addr, input, width, len);
+        pthread_mutex_unlock(&vm_lock);
+        return;
     }
-    int phys_addr = translate_ptable(pid, v_addr);
-    int v_page= find_page(v_addr);
-    char buffer[10] = "";
 
-    if (write_list[pid][v_page] == 1)
+    pthread_mutex_lock(&proc_lock[pid]);
+    if ((inst_type == 2 || inst_type == 3) && !ws_due() && is_resident(pid, v_addr))
+    {
+        run_instruction(pid, inst_type, v_addr, input, width, len);
+        pthread_mutex_unlock(&proc_lock[pid]);
+        return;
+    }
+
+    // Retake the process's lock after vm_lock to keep the lock order, the fault is handled from scratch
+    pthread_mutex_unlock(&proc_lock[pid]);
+    pthread_mutex_lock(&vm_lock);
+    pthread_mutex_lock(&proc_lock[pid]);
+    held_pid = pid;
+    run_instruction(pid, inst_type, v_addr, input, width, len);
+    refill_free_pool(pid);
+    if (ws_due())
+    {
+        ws_sample();
+    }
+    held_pid = -1;
+    pthread_mutex_unlock(&proc_lock[pid]);
+    pthread_mutex_unlock(&vm_lock);
+}
+
+// Runs the trace records of every process assigned to one worker thread, in trace order
+void *worker_main(void *arg)
+{
+    int worker = (int)(intptr_t)arg;
+    for (int i = 0; i < trace_len; i++)
     {
-        if (page_exists[pid][v_page] == 1)
+        if (trace[i].pid % num_threads == worker)
         {
-            if (on_disk[pid][v_page + 1] != -1)
-            {
-                replace_page(pid, v_page);
-            }
-            sprintf(buffer, "%d", value);
-            int num_bytes = write_mem(phys_addr, buffer);
-            if (num_bytes == -1)
-            {
-                printf("ERROR: Write goes over end of page! Value not stored\n");
-            }
-            else
-            {
-                printf("Stored value %d at virtual address %d (physical address %d)\n", value, v_addr, phys_addr);
-            }
+            run_threaded(trace[i].pid, trace[i].op, trace[i].v_addr, trace[i].value, trace[i].width, trace[i].len);
         }
-        else
+    }
+    return NULL;
+}
+
+// Runs the trace on num_threads worker threads, process pid runs on worker pid % num_threads
+int run_threads()
+{
+    pthread_t workers[num_threads];
+    int started = 0;
+    for (started = 0; started < num_threads; started++)
+    {
+        if (pthread_create(&workers[started], NULL, worker_main, (void *)(intptr_t)started) != 0)
         {
-            printf("ERROR: Virtual page %d has not been allocated for process %d!\n", v_page, pid);
+            printf("ERROR: Cannot start worker thread %d\n", started);
+            break;
         }
     }
-    else
+    for (int i = 0; i < started; i++)
     {
-        printf("ERROR: Writes are not allowed to this page\n");
+        pthread_join(workers[i], NULL);
     }
-
-    return 0; // Success
+    return started == num_threads ? 0 : -1;
 }
 
-// Loads value from physical memory
-int load(int pid, int v_addr)
+// Runs every instruction of a binary trace file, the file is mapped into memory instead of read line by line
+int replay_trace(char *path)
 {
-    int v_page = find_page(v_addr);
-    //printf("On disk for ptable %d: %d, Ptable Address: %d\n", pid, on_disk[pid][0], pid_array[pid]);
-    if (on_disk[pid][0] != -1 || pid_array[pid] == -1)
-    {
-        int to_evict = evict(pid);
-        swap(to_evict, on_disk[pid][0]);
-        on_disk[pid][0] = -1;
-        pid_array[pid] = find_address(last_evict);
-    }
-    //printf("On disk for v_page %d: %d\n", v_page, on_disk[pid][v_page + 1]);
-    if (on_disk[pid][v_page + 1] != -1)
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)strlen(TRACE_MAGIC))
     {
-        replace_page(pid, v_page);
+        printf("ERROR: Cannot open trace %s\n", path);
+        return -1;
     }
-    int phys_addr = translate_ptable(pid, v_addr);
-    int value = read_mem(phys_addr);
-    if  (value == -1)
+
+    unsigned char *map_start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map_start == MAP_FAILED || memcmp(map_start, TRACE_MAGIC, strlen(TRACE_MAGIC) - 1) != 0)
     {
-        printf("ERROR: No value stored at virtual address %d (physical address %d)\n", v_addr, phys_addr);
+        printf("ERROR: %s is not a binary trace\n", path);
+        return -1;
     }
-    else
+    if (memcmp(map_start, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0)
     {
-        printf("The value %d is virtual address %d (physical address %d)\n", value, v_addr, phys_addr);
+        printf("ERROR: %s is a binary trace of another version, convert it again\n", path);
+        return -1;
     }
+    madvise(map_start, st.st_size, MADV_SEQUENTIAL);
 
-    return 0; // Success
+    trace = (trace_record *)(map_start + strlen(TRACE_MAGIC));
+    trace_len = (st.st_size - strlen(TRACE_MAGIC)) / sizeof(trace_record);
+    int result = run_trace();
+
+    munmap(map_start, st.st_size);
+    trace = NULL;
+    return result;
 }
 
-// Chooses physical page to evict from memory
-// Current algorithm is round robin, will skip page if it is the process's page table
-int evict(int pid)
+// Runs the trace records in memory on the worker threads or in order, the run is timed for the statistics
+int run_trace()
 {
-    int ptable = find_page(pid_array[pid]); // Physical page where pid's ptable is
+    struct timespec start, end;
+    if (cur_policy->choose == evict_opt && opt_prepare() == -1)
+    {
+        return -1;
+    }
 
-    int cur_evict = last_evict + 1;
-    if (cur_evict >= 4)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (num_threads > 0)
     {
-        cur_evict = 0;
+        run_threads();
     }
-    if (cur_evict == ptable)
+    for (trace_pos = 0; num_threads == 0 && trace_pos < trace_len; trace_pos++)
     {
-        cur_evict++;
-        if (cur_evict >= 4)
-        {
-            cur_evict = 0;
-        }
+        trace_record *record = &trace[trace_pos];
+        opt_advance(trace_pos);
+        run_instruction(record->pid, record->op, record->v_addr, record->value, record->width, record->len);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    last_evict = cur_evict;
-    return cur_evict;
+    run_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return 0;
 }
 
-// Changes mapping of virtual page in a page table when swapping in from disk
-int remap(int pid, int v_page, int p_page)
+// Writes the text instructions on stdin, or a generated trace, as a binary trace file
+int convert_trace(char *path)
 {
-    int write_addr = pid_array[pid];
-    for(int j = 0; j < 16; j++)
+    char buffer[64];
+    trace_record record;
+    int line = 0;
+
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+    {
+        printf("ERROR: Cannot open trace %s\n", path);
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), out);
+    if (trace != NULL)
     {
-        if (memory[write_addr] == ',') // Pointer on in-between position
+        fwrite(trace, sizeof(trace_record), trace_len, out); // Generated trace
+    }
+    while (trace == NULL && fgets(buffer, sizeof(buffer), stdin) != NULL)
+    {
+        line++;
+        if (parse_record(buffer, &record) == -1)
         {
-	if(memory[write_addr - 1] == v_page)
-	memory[write_addr + 1] = p_page;            
+            printf("ERROR: Skipping invalid instruction on line %d\n", line);
+            continue;
+        }
+        fwrite(&record, sizeof(record), 1, out);
+    }
 
-		write_addr++;
-	}
+    fclose(out);
+    return 0;
 }
 
-    printf("Remapped virtual page %d into physical frame %d\n", v_page, p_page);
-
-    return 0; //Success
+// Returns the next number of the workload generator, xorshift64* so a seed gives the same trace everywhere
+unsigned long long gen_random()
+{
+    gen_state ^= gen_state >> 12;
+    gen_state ^= gen_state << 25;
+    gen_state ^= gen_state >> 27;
+    return gen_state * 0x2545F4914F6CDD1DULL;
 }
 
-// Swaps page, handles array data for disk location
-int replace_page(int pid, int v_page)
+// Generates the trace of a synthetic workload: every process maps all of its pages read-write, then gen_len loads and stores follow
+int gen_trace()
 {
-    int to_evict = evict(pid);
-    int disk_loc = -1;
-    int r_ptable = -1;
-    int r_pid = -1;
-    int r_vpage = -1;
-    if (v_page != -1)
+    long long pages = max_pages;
+    long long loop_pages = (long long)num_frames * 5 / (4 * max_proc); // 25% more than a process's share of memory
+    long long phase_pages = num_frames / (2 * max_proc); // Half of a process's share of memory
+    long long phase_len = gen_len / 8 > 0 ? gen_len / 8 : 1;
+    loop_pages = loop_pages < 1 ? 1 : loop_pages > pages ? pages : loop_pages;
+    phase_pages = phase_pages < 1 ? 1 : phase_pages > pages ? pages : phase_pages;
+
+    if (gen_len < 0 || pages * max_proc + gen_len > INT32_MAX)
+    {
+        printf("ERROR: A workload of %lld instructions over %lld virtual pages is too long\n", gen_len, pages * max_proc);
+        return -1;
+    }
+    trace_len = (int)(pages * max_proc + gen_len);
+    trace = malloc(trace_len * sizeof(trace_record));
+    long long *cursor = calloc(max_proc, sizeof(long long)); // Next address of a scan or next page of a loop
+    long long *phase_base = calloc(max_proc, sizeof(long long)); // First page of the working set of a phase
+    double *zipf = gen_workload == 1 || gen_workload == 5 ? malloc(pages * sizeof(double)) : NULL; // Cumulative Zipf distribution, exponent 1
+    if (trace == NULL || cursor == NULL || phase_base == NULL || ((gen_workload == 1 || gen_workload == 5) && zipf == NULL))
     {
-        disk_loc = on_disk[pid][v_page + 1];
-        if (disk_loc == -1) disk_loc = 0;
+        printf("ERROR: Cannot allocate workload\n");
+        return -1;
+    }
+    if (gen_state == 0)
+    {
+        gen_state = 1; // xorshift never leaves 0
     }
-    int new_line = -1;
 
-    for (int i = 0; i < MAX_PROC; i++)
+    double sum = 0;
+    for (long long i = 0; zipf != NULL && i < pages; i++)
     {
-        if (find_address(to_evict) == pid_array[i])
-        {
-            r_ptable = i;
-        }
+        sum += 1.0 / (i + 1);
+        zipf[i] = sum;
     }
-    if (r_ptable != -1)
+
+    int n = 0;
+    for (int pid = 0; pid < max_proc; pid++)
     {
-        r_vpage = -1;
-        r_pid = r_ptable;
+        for (long long v_page = 0; v_page < pages; v_page++)
+        {
+            trace[n++] = (trace_record){pid, 1, 4, 0, 1, v_page * page_size};
+        }
     }
 
-    else
+    for (long long i = 0; i < gen_len; i++)
     {
-        // Find the process and page we are removing from memory
-        for (int i = 0; i < MAX_PROC; i++)
+        int pid = gen_random() % max_proc;
+        int kind = gen_workload == 5 ? pid % 5 : gen_workload;
+        long long word = (gen_random() % (page_size / 4)) * 4;
+        long long v_addr = 0;
+        if (i % phase_len == 0)
         {
-            if (pid_array[i] != -1)
+            for (int j = 0; j < max_proc; j++)
             {
-                int cur_addr = pid_array[i];
-                for (int j = 0; j < 16; j++) // Only look up to end of page table virtual page
-                {
-                    if (memory[cur_addr] == ',') // PTE Separator
-                    {
-                        if(memory[cur_addr + 1] - '0' == to_evict)
-                        {
-                            r_pid = i;
-                            r_vpage = memory[cur_addr - 1] - '0';
-                            //printf("test1\n");
-                        }
-                    }
-                    cur_addr++;
-                }
+                phase_base[j] = gen_random() % (pages - phase_pages + 1);
             }
         }
 
-        // Page table we need is on disk
-        int cur_ptable = -1;
-        if (r_pid == -1)
+        if (kind == 0)
+        {
+            v_addr = (gen_random() % pages) * page_size + word;
+        }
+        else if (kind == 1)
         {
-            for (int i = 0; i < MAX_PROC; i++)
+            // Binary search for the first page whose cumulative weight passes a uniform draw
+            double u = (gen_random() >> 11) * (1.0 / (1ULL << 53)) * sum;
+            long long low = 0;
+            long long high = pages - 1;
+            while (low < high)
             {
-                cur_ptable = on_disk[i][0];
-                //printf("test3: On disk for pid %d: is %d, table address is %d\n", i, on_disk[i][0], pid_array[i]);
-                if (on_disk[i][0] != -1)
+                long long mid = (low + high) / 2;
+                if (zipf[mid] < u)
+                {
+                    low = mid + 1;
+                }
+                else
                 {
-                    swap(to_evict, cur_ptable);
-                    pid_array[i] = find_address(to_evict);
-                    int cur_addr = pid_array[i];
-                    for (int j = 0; j < 16; j++) // Only look up to end of page table virtual page
-                    {
-                        //printf("%d, %d, %c\n", i, cur_addr, memory[cur_addr]);
-                        if (memory[cur_addr] == ',') // PTE Separator
-                        {
-                            if(memory[cur_addr + 1] - '0' == to_evict)
-                            {
-                                r_pid = i;
-                                r_vpage = memory[cur_addr - 1] - '0';
-                                //printf("test2\n");
-                            }
-                        }
-                        cur_addr++;
-                    }
+                    high = mid;
                 }
-                if (r_pid != -1) break;
             }
+            v_addr = low * page_size + word;
+        }
+        else if (kind == 2)
+        {
+            v_addr = cursor[pid];
+            cursor[pid] = (cursor[pid] + 4) % (pages * page_size);
+        }
+        else if (kind == 3)
+        {
+            v_addr = cursor[pid] * page_size + word;
+            cursor[pid] = (cursor[pid] + 1) % loop_pages;
+        }
+        else
+        {
+            v_addr = (phase_base[pid] + gen_random() % phase_pages) * page_size + word;
         }
-    }
-if(r_pid == -1)
-{
-printf("ccALERT, PROCESS DONT EXIST\n");
-}
 
-    new_line = swap(to_evict, disk_loc); // Swap pages
-    free_list[to_evict] = -1; // Deallocated physical page
-    if (v_page != -1)
-    {
-        remap(pid, v_page, to_evict); // Remaps swapped in page to a physical page
-        on_disk[pid][v_page + 1] = -1; // Update page that was swapped from disk
-        free_list[to_evict] = 0;
+        // One access in three is a store, so evicted pages are dirty often enough to be written back
+        if (gen_random() % 3 == 0)
+        {
+            trace[n++] = (trace_record){pid, 2, 4, 0, (int64_t)(gen_random() % 1000000), v_addr};
+        }
+        else
+        {
+            trace[n++] = (trace_record){pid, 3, 4, 0, 0, v_addr};
+        }
     }
-    //printf("Replace pid: %d, Replace v_page: %d\n", r_pid, r_vpage);
-    on_disk[r_pid][r_vpage + 1] = new_line; // Update page that was swapped to disk
-    //printf("To evict: %d\n", to_evict);
-    //logMem();
 
-    return 0; // Success
+    free(cursor);
+    free(phase_base);
+    free(zipf);
+    return 0;
 }
 
-// Swaps page from physical memory and disk, returns lineNum page was put in disk
-int swap(int page, int lineNum)
+// Lists the arrays saved in a checkpoint image in the order they are written, the swap file's arrays must already have disk_slots entries
+int ckpt_sections(ckpt_section *sections)
 {
-    int start = find_address(page);
-    char putTemp[16];
-    char getTemp[16];
-    int replaceMem = -1;
-    int putLine = -1;
-    int ptable_flag = -1;
-
-    // If page to swap is a page table, erase address in pid_array
-    for(int i = 0; i < MAX_PROC; i++)
-    {
-        if (start == pid_array[i])
-        {
-            pid_array[i] = -1;
-            ptable_flag = i;
-        }
-    }
+    int n = 0;
+    sections[n++] = (ckpt_section){memory, mem_size};
+    sections[n++] = (ckpt_section){pid_array, max_proc * sizeof(int)};
+    sections[n++] = (ckpt_section){on_disk, max_proc * sizeof(int)};
+    sections[n++] = (ckpt_section){prefetch, max_proc * sizeof(prefetch_state)};
+    sections[n++] = (ckpt_section){rss, max_proc * sizeof(rss_state)};
+    sections[n++] = (ckpt_section){pid_stats, max_proc * sizeof(vm_stats)};
+    sections[n++] = (ckpt_section){tlb_hits, max_proc * sizeof(long long)};
+    sections[n++] = (ckpt_section){tlb_misses, max_proc * sizeof(long long)};
+    sections[n++] = (ckpt_section){lat, max_proc * sizeof(lat_state)};
+    sections[n++] = (ckpt_section){free_list, num_frames * sizeof(int)};
+    sections[n++] = (ckpt_section){frame_slot, num_frames * sizeof(int)};
+    sections[n++] = (ckpt_section){rmap, num_frames * sizeof(rmap_entry)};
+    sections[n++] = (ckpt_section){frame_sharers, num_frames * sizeof(int)};
+    sections[n++] = (ckpt_section){frame_refs, num_frames * sizeof(int)};
+    sections[n++] = (ckpt_section){frame_huge, num_frames};
+    sections[n++] = (ckpt_section){frame_prefetched, num_frames};
+    sections[n++] = (ckpt_section){frame_loaded, num_frames * sizeof(unsigned int)};
+    sections[n++] = (ckpt_section){frame_last_use, num_frames * sizeof(unsigned int)};
+    sections[n++] = (ckpt_section){frame_uses, num_frames * sizeof(unsigned int)};
+    sections[n++] = (ckpt_section){frame_ref, num_frames};
+    sections[n++] = (ckpt_section){frame_stats, num_frames * sizeof(vm_stats)};
+    sections[n++] = (ckpt_section){tlb, tlb_size * sizeof(tlb_entry)};
+    sections[n++] = (ckpt_section){sharers, sharers_cap * sizeof(sharer_entry)};
+    sections[n++] = (ckpt_section){shm_table, (shm_mask + 1) * sizeof(shm_entry)};
+    sections[n++] = (ckpt_section){disk_used, disk_slots / 64 * sizeof(uint64_t)};
+    sections[n++] = (ckpt_section){slot_refs, disk_slots * sizeof(int)};
+    sections[n++] = (ckpt_section){slot_frame, disk_slots * sizeof(int)};
+    return n;
+}
 
-    for(int i = 0; i < 16; i++)
-    {
-        putTemp[i] = memory[start + i];
-    }
-    /*for (int i = 0; i < 16; i++)
+// Writes the whole machine state to a checkpoint image, the write-back queue must already be empty
+// Only the swap slots in use are saved, and the swap pool is saved compressed, oldest page first
+int checkpoint_save(char *path)
+{
+    checkpoint_header header = {
+        .mem_size = mem_size, .page_size = page_size, .max_proc = max_proc, .max_pages = max_pages, .tlb_size = tlb_size, .tlb_ways = tlb_ways,
+        .disk_slots = disk_slots, .disk_hint = disk_hint, .sharers_cap = sharers_cap, .sharers_free = sharers_free, .shm_mask = shm_mask, .shm_count = shm_count,
+        .fork_count = fork_count, .large_pages = large_pages, .free_frames = free_frames, .last_evict = last_evict, .clock_hand = clock_hand,
+        .access_clock = access_clock, .tlb_clock = tlb_clock, .ws_interval = ws_interval, .ws_next = ws_next, .ws_last_inst = ws_last_inst, .ws_samples = ws_samples,
+        .inst_count = inst_count, .cow_faults = cow_faults, .cow_copies = cow_copies, .zero_maps = zero_maps, .zero_reads = zero_reads, .zero_fills = zero_fills,
+        .unmapped_pages = unmapped_pages, .freed_frames = freed_frames, .freed_slots = freed_slots,
+        .zswap_stored = zswap_stored, .zswap_bytes = zswap_bytes, .zswap_rejected = zswap_rejected, .zswap_loads = zswap_loads, .zswap_spilled = zswap_spilled,
+        .disk_writes = disk_writes, .disk_reads = disk_reads, .wb_written = wb_written, .wb_merged = wb_merged, .wb_stalls = wb_stalls,
+        .sim_time = sim_time, .disk_free_at = disk_free_at, .disk_wait = disk_wait};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    for (int slot = zswap_oldest; zswap_limit > 0 && slot != -1; slot = zswap[slot].newer)
     {
-        printf("%c", putTemp[i]);
+        header.zswap_pages++;
     }
-    printf("\n");*/
 
-    if(lineNum != -1) // If lineNum is -1, don't try to get something from disk
-    	replaceMem = getFromDisk(&getTemp, lineNum);
-    putLine = putToDisk(putTemp);
-
-    if(putLine == -1)
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
     {
-        printf("ERROR: Could not put page to disk.\n");
+        printf("ERROR: Cannot open checkpoint %s\n", path);
         return -1;
     }
-    else if(replaceMem != -1)
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    ckpt_section sections[32];
+    int count = ckpt_sections(sections);
+    fwrite(&header, sizeof(header), 1, out);
+    for (int i = 0; i < count; i++)
     {
-        for(int i = 0; i < 16; i++)
+        if (sections[i].len > 0)
         {
-            memory[start + i] = getTemp[i];
+            fwrite(sections[i].data, 1, sections[i].len, out);
         }
     }
-    else // Cannot swap in new memory after putting old in disk, replace memory with empty page
+    for (int slot = 0; slot < disk_slots; slot++)
     {
-        for(int i = 0; i < 16; i++)
+        if (disk_used[slot / 64] & ((uint64_t)1 << (slot % 64)))
         {
-            memory[start + i] = '*';
+            fwrite(&disk_map[(size_t)slot * page_size], 1, page_size, out);
         }
     }
-    //logMem();
-    printf("Swapped frame %d to disk at swap slot %d\n", page, putLine);
-    if (lineNum != -1)
+    for (int slot = zswap_oldest; zswap_limit > 0 && slot != -1; slot = zswap[slot].newer)
     {
-        printf("Swapped disk slot %d into frame %d\n", lineNum, page);
-        //printf("%s\n", getTemp);
+        fwrite(&slot, sizeof(int), 1, out);
+        fwrite(&zswap[slot].len, sizeof(int), 1, out);
+        fwrite(zswap[slot].data, 1, zswap[slot].len, out);
     }
-    if (ptable_flag != -1)
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed)
+    {
+        printf("ERROR: Cannot write checkpoint %s\n", path);
+        return -1;
+    }
+    LOG(LOG_SUMMARY, "Saved the machine after %lld instructions to checkpoint %s\n", inst_count, path);
+    return 0;
+}
+
+// Takes the memory geometry from a checkpoint image's header, before anything is allocated
+int checkpoint_geometry(char *path)
+{
+    checkpoint_header header;
+    FILE *in = fopen(path, "rb");
+    if (in == NULL || fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
     {
-        printf("Put page table for PID %d into swap slot %d\n", ptable_flag, putLine);
-        /*for (int i = 0; i < 16; i++)
+        printf("ERROR: %s is not a checkpoint\n", path);
+        if (in != NULL)
         {
-            printf("%c", putTemp[i]);
+            fclose(in);
         }
-        printf("\n");*/
-        on_disk[ptable_flag][0] = putLine;
-        pid_array[ptable_flag] = -1;
+        return -1;
     }
-    return putLine;
+    fclose(in);
+
+    mem_size = header.mem_size;
+    page_size = header.page_size;
+    max_proc = header.max_proc;
+    max_pages = header.max_pages;
+    tlb_size = header.tlb_size;
+    tlb_ways = header.tlb_ways;
+    return 0;
 }
 
-// Puts page in disk
-int putToDisk(char page[16])
+// Loads the machine state from a checkpoint image mapped in one piece, over the empty machine that init_memory and disk_init set up
+// Pages of the swap pool go back into the pool if this run has one, and into the swap file otherwise
+int checkpoint_restore(char *path)
 {
-    int line_placement = -1; // Where line is on disk
-    char currChar;
-    int pageCounter = 0; // Counts each character of a page
-
-    disk = fopen("disk.txt", "r+");
-    if(disk == NULL)
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(checkpoint_header))
     {
-        printf("ERROR: Cannot open disk in putToDisk.\n");
+        printf("ERROR: Cannot open checkpoint %s\n", path);
         return -1;
     }
-
-    do
+    unsigned char *map_start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map_start == MAP_FAILED)
     {
-        currChar = fgetc(disk);
-        pageCounter++;
+        printf("ERROR: Cannot map checkpoint %s\n", path);
+        return -1;
+    }
+    madvise(map_start, st.st_size, MADV_SEQUENTIAL);
 
-        if(feof(disk)) // Empty file, put page in
+    checkpoint_header header;
+    memcpy(&header, map_start, sizeof(header));
+    while (disk_slots < header.disk_slots)
+    {
+        if (disk_grow() == -1)
         {
-            for(int i = 0; i < 16; i++)
-            {
-                fputc(page[i], disk);
-            }
-            fputc('\n', disk);
-            line_placement = 0;
-            break;
+            munmap(map_start, st.st_size);
+            return -1;
         }
-        else // Look for a free space
+    }
+    sharers_cap = header.sharers_cap;
+    sharers = realloc(sharers, (sharers_cap > 0 ? sharers_cap : 1) * sizeof(sharer_entry));
+    shm_mask = header.shm_mask;
+    shm_table = malloc((shm_mask + 1 > 0 ? shm_mask + 1 : 1) * sizeof(shm_entry));
+    if (sharers == NULL || shm_table == NULL)
+    {
+        printf("ERROR: Cannot allocate checkpoint %s\n", path);
+        munmap(map_start, st.st_size);
+        return -1;
+    }
+
+    // The image must hold every section, every used swap slot and every page of the swap pool
+    ckpt_section sections[32];
+    int count = ckpt_sections(sections);
+    size_t need = sizeof(header);
+    for (int i = 0; i < count; i++)
+    {
+        need += sections[i].len;
+    }
+    unsigned char *pos = map_start + sizeof(header);
+    uint64_t *saved_used = (uint64_t *)(map_start + need - sections[count - 3].len - sections[count - 2].len - sections[count - 1].len);
+    for (int slot = 0; need <= (size_t)st.st_size && slot < disk_slots; slot++)
+    {
+        if (saved_used[slot / 64] & ((uint64_t)1 << (slot % 64)))
         {
-            if(pageCounter == 16)
-            {
-                line_placement++;
-            }
-            if(currChar == '!' && pageCounter == 16) // This line in disk is free, all '!'
-            {
-                fseek(disk, -16, SEEK_CUR);
-                for(int i = 0; i < 16; i++)
-                {
-                    fputc(page[i], disk);
-                }
-                break;
-            }
-            else if(pageCounter > 16)
-            {
-                pageCounter = 0;
-            }
+            need += page_size;
         }
     }
-    while(currChar != EOF);
-
-    fclose(disk);
-    return line_placement;
-}
-
-// Gets page from disk
-int getFromDisk(char (*pageHolder)[16], int lineNum)
-{
-    int line_placement = -1; // Where line is on disk
-    char currChar;
-    int pageCounter = 0; // Counts each character of a page
-
-    disk = fopen("disk.txt", "r+");
-    if(disk == NULL)
+    if (need > (size_t)st.st_size)
     {
-	printf("ERROR: Cannot open disk in getFromDisk.\n");
+        printf("ERROR: Checkpoint %s is cut short\n", path);
+        munmap(map_start, st.st_size);
         return -1;
     }
 
-    do
+    for (int i = 0; i < count; i++)
     {
-        currChar = fgetc(disk);
-        pageCounter++;
-
-        if(feof(disk) && line_placement == -1)
+        memcpy(sections[i].data, pos, sections[i].len);
+        pos += sections[i].len;
+    }
+    for (int slot = 0; slot < disk_slots; slot++)
+    {
+        if (disk_used[slot / 64] & ((uint64_t)1 << (slot % 64)))
         {
-            printf("ERROR: Cannot get page from empty disk.\n");
+            memcpy(&disk_map[(size_t)slot * page_size], pos, page_size);
+            pos += page_size;
+        }
+    }
 
-            fclose(disk);
-            return -1;
+    disk_hint = header.disk_hint;
+    sharers_free = header.sharers_free;
+    shm_count = header.shm_count;
+    fork_count = header.fork_count;
+    large_pages = header.large_pages;
+    free_frames = header.free_frames;
+    last_evict = header.last_evict;
+    clock_hand = header.clock_hand;
+    access_clock = header.access_clock;
+    tlb_clock = header.tlb_clock;
+    ws_last_inst = header.ws_last_inst;
+    ws_samples = header.ws_samples;
+    inst_count = header.inst_count;
+    ws_next = header.ws_interval == ws_interval ? header.ws_next : inst_count + ws_interval;
+    cow_faults = header.cow_faults;
+    cow_copies = header.cow_copies;
+    zero_maps = header.zero_maps;
+    zero_reads = header.zero_reads;
+    zero_fills = header.zero_fills;
+    unmapped_pages = header.unmapped_pages;
+    freed_frames = header.freed_frames;
+    freed_slots = header.freed_slots;
+    zswap_stored = header.zswap_stored;
+    zswap_bytes = header.zswap_bytes;
+    zswap_rejected = header.zswap_rejected;
+    zswap_loads = header.zswap_loads;
+    zswap_spilled = header.zswap_spilled;
+    disk_writes = header.disk_writes;
+    disk_reads = header.disk_reads;
+    wb_written = header.wb_written;
+    wb_merged = header.wb_merged;
+    wb_stalls = header.wb_stalls;
+    sim_time = header.sim_time;
+    disk_wait = header.disk_wait;
+
+    for (long long i = 0; i < header.zswap_pages; i++)
+    {
+        int slot;
+        int len;
+        if (pos + 2 * sizeof(int) > map_start + st.st_size)
+        {
+            break;
         }
-        else
+        memcpy(&slot, pos, sizeof(int));
+        memcpy(&len, pos + sizeof(int), sizeof(int));
+        pos += 2 * sizeof(int);
+        if (slot < 0 || slot >= disk_slots || len <= 0 || len > page_size || pos + len > map_start + st.st_size)
+        {
+            break;
+        }
+
+        if (zswap_limit > 0)
         {
-            if(pageCounter == 16)
+            // Newest end of the pool, making room the way a store to the pool would
+            while (zswap_used + len > zswap_limit && zswap_oldest != -1)
             {
-                line_placement++;
+                zswap_spill();
             }
-            if(line_placement == lineNum && pageCounter == 16) // Get this line from disk
+            zswap_entry *entry = &zswap[slot];
+            entry->data = malloc(len);
+            memcpy(entry->data, pos, len);
+            entry->len = len;
+            entry->older = zswap_newest;
+            entry->newer = -1;
+            if (zswap_newest != -1)
             {
-                fseek(disk, -16, SEEK_CUR);
-                for(int i = 0; i < 16; i++)
-                {
-                    currChar = fgetc(disk);
-                    (*pageHolder)[i] = currChar;
-                    fseek(disk, -1, SEEK_CUR);
-                    fputc('!', disk); // Replace this line with a free line, all '!'
-                }
-                fputc('\n', disk);
-
-                fclose(disk);
-                return 0;
+                zswap[zswap_newest].newer = slot;
             }
-            else if(pageCounter > 16)
+            else
             {
-                pageCounter = 0;
+                zswap_oldest = slot;
             }
+            zswap_newest = slot;
+            zswap_used += len;
         }
+        else
+        {
+            zs_decompress(pos, len, &disk_map[(size_t)slot * page_size]);
+        }
+        pos += len;
     }
-    while(currChar != EOF);
+    disk_free_at = header.disk_free_at; // Spilling the swap pool above took no simulated time
 
-    fclose(disk);
-    return -1;
+    munmap(map_start, st.st_size);
+    LOG(LOG_SUMMARY, "Restored the machine after %lld instructions from checkpoint %s\n", inst_count, path);
+    return 0;
 }
 
 // Main
@@ -713,72 +4978,125 @@ int main(int argc, char *argv[])
 {
     int pid = 0; // Process ID
     int inst_type = 0; // Instruction type
-    int v_addr = 0; // Virtual address
-    int input = 0; // Value
+    long long v_addr = 0; // Virtual address
+    long long input = 0; // Value
+    int width = 4; // Bytes loaded or stored
+    int len = 0; // Bytes copied or filled
     int is_end = 0; // Boolean for ending simulation
+    int arg = 0; // Index of the first instruction argument in argv
 
-    char buffer[20]; // Holds stdin buffer
-    char cmd_seq[20]; // The command sequence read from stdin
-    char* cmd_array[4]; // Holds the commands read from file
+    char buffer[64]; // Holds stdin buffer
+    char cmd_seq[64]; // The command sequence read from stdin
+    char* cmd_array[5]; // Holds the commands read from file
     char* token;
 
+    // Read memory geometry
+    arg = parse_args(argc, argv);
+    if (arg == -1 || init_memory() == -1)
+    {
+        return -1;
+    }
+
+    // Buffer output heavily unless someone is typing instructions
+    if (!isatty(STDIN_FILENO))
+    {
+        setvbuf(stdout, NULL, _IOFBF, LOG_BUFFER);
+    }
+
     // Clean disk
-    disk = fopen("disk.txt", "w");
-    if(disk == NULL)
+    if (disk_init() == -1)
+    {
+        return -1;
+    }
+
+    // Start from a saved machine
+    if (restore_file != NULL && checkpoint_restore(restore_file) == -1)
     {
-	printf("ERROR: Cannot open disk in main.");
-	return -1;
+        return -1;
     }
-    else
-    	fclose(disk);
 
-    // Initialize ptable, free and write lists
-    for (int i = 0; i < MAX_PROC; i++)
+    // Generate a synthetic workload instead of reading instructions
+    if (gen_workload >= 0 && gen_trace() == -1)
     {
-        pid_array[i] = -1;
-        free_list[i] = -1;
-        for (int j = 0; j < MAX_PAGES + 1; j++)
+        return -1;
+    }
+
+    // Write a binary trace instead of running anything
+    if (convert_file != NULL)
+    {
+        return convert_trace(convert_file);
+    }
+
+    // Replay a binary trace or a generated workload without any per-instruction prompts
+    if (replay_file != NULL || gen_workload >= 0)
+    {
+        if (replay_file != NULL)
         {
-            if (j < 4)
-            {
-                write_list[i][j] = 0;
-                page_exists[i][j] = 0;
-            }
-            on_disk[i][j] = -1;
+            replay_trace(replay_file);
         }
+        else
+        {
+            run_trace();
+        }
+        wb_close();
+        if (checkpoint_file != NULL)
+        {
+            checkpoint_save(checkpoint_file);
+        }
+        stats_report();
+        log_close();
+        return 0;
     }
 
-    // Initialize physical memory
-    for (int i = 0; i < SIZE; i++)
+    // Worker threads need the whole trace before they start, the instructions are not echoed
+    if (num_threads > 0 && argc <= arg)
+    {
+        if (read_text_trace() == -1)
+        {
+            return -1;
+        }
+        run_trace();
+        wb_close();
+        if (checkpoint_file != NULL)
+        {
+            checkpoint_save(checkpoint_file);
+        }
+        stats_report();
+        log_close();
+        return 0;
+    }
+
+    // OPT needs to know the whole trace before it starts
+    if (cur_policy->choose == evict_opt && argc <= arg && (read_text_trace() == -1 || opt_prepare() == -1))
     {
-        memory[i] = '*';
+        return -1;
     }
 
     while (is_end != 1)
     {
-        printf("Instruction?: ");
+        LOG(LOG_EVENTS, "Instruction?: ");
         // Receive stdin
-        if (argc <= 1)
+        if (argc <= arg)
         {
             // Read sequence from file
-            if (fgets(buffer, sizeof(buffer), stdin) == NULL)
+            if (read_instruction(buffer, sizeof(buffer)) == NULL)
             {
                 is_end = 1;
-                printf("End of File. Exiting\n");
+                LOG(LOG_EVENTS, "End of File. Exiting\n");
                 break;
             }
             buffer[strcspn(buffer, "\n")] = 0; // Remove newline
             strncpy(cmd_seq, &buffer[0], sizeof(cmd_seq));
-            printf("%s\n", cmd_seq);
+            LOG(LOG_EVENTS, "%s\n", cmd_seq);
 
             // Parse sequence
             token = strtok(cmd_seq, " ");
             int i = 0;
             while (token != NULL)
             {
-                if (i >= 4)
+                if (i >= 5)
                 {
-                    printf("ERROR: Too many input arguments!\n");
+                    LOG(LOG_EVENTS, "ERROR: Too many input arguments!\n");
                     break;
                 }
                 cmd_array[i] = token;
@@ -786,84 +5104,60 @@ int main(int argc, char *argv[])
                 token = strtok(NULL, " ");
             }
 
-            // Put sequence into variables
-            pid = atoi(cmd_array[0]);
-
-            if (strncmp(cmd_array[1], "map", sizeof(cmd_array[1])) == 0)
-            {
-                inst_type = 1;
-            }
-            else if (strncmp(cmd_array[1], "store", sizeof(cmd_array[1])) == 0)
-            {
-                inst_type = 2;
-            }
-            else if (strncmp(cmd_array[1], "load", sizeof(cmd_array[1])) == 0)
+            if (i < 2)
             {
-                inst_type = 3;
+                LOG(LOG_EVENTS, "ERROR: Not enough input arguments!\n");
+                continue;
             }
-            v_addr = atoi(cmd_array[2]);
-            input = atoi(cmd_array[3]);
+
+            // Put sequence into variables
+            pid = atoi(cmd_array[0]);
+            inst_type = parse_op(cmd_array[1], &width);
+            v_addr = i > 2 ? atoll(cmd_array[2]) : 0;
+            input = i > 3 ? atoll(cmd_array[3]) : 0;
+            len = i > 4 ? atoi(cmd_array[4]) : 0;
         }
 
         // Read argv
         else
         {
-            if (argc >= 2)
+            if (argc >= arg + 1)
             {
-                pid = atoi(argv[1]);
+                pid = atoi(argv[arg]);
             }
-            if (argc >= 3)
+            if (argc >= arg + 2)
             {
-                if (strncmp(argv[2], "map", sizeof(argv[2])) == 0)
-                {
-                    inst_type = 1;
-                }
-                else if (strncmp(argv[2], "store", sizeof(argv[2])) == 0)
-                {
-                    inst_type = 2;
-                }
-                else if (strncmp(argv[2], "load", sizeof(argv[2])) == 0)
-                {
-                    inst_type = 3;
-                }
+                inst_type = parse_op(argv[arg + 1], &width);
+            }
+            if (argc >= arg + 3)
+            {
+                v_addr = atoll(argv[arg + 2]);
             }
-            if (argc >= 4)
+            if (argc >= arg + 4)
             {
-                v_addr = atoi(argv[3]);
+                input = atoll(argv[arg + 3]);
             }
-            if (argc >= 5)
+            if (argc >= arg + 5)
             {
-                input = atoi(argv[4]);
+                len = atoi(argv[arg + 4]);
             }
+            LOG(LOG_EVENTS, "%s %s %lld %lld\n", argv[arg], argc >= arg + 2 ? argv[arg + 1] : "", v_addr, input);
+            is_end = 1; // Only one instruction is given on the command line
         }
 
-        if (is_end == 1) break; // Break if EOF
-
+        run_instruction(pid, inst_type, v_addr, input, width, len);
+    }
 
-        if (pid >= 4 || pid < 0)
-        {
-            printf("ERROR: Process ID %d is invalid! Only ID's 0 to 3 are allowed\n", pid);
-        }
-        else if (v_addr >= 64 || v_addr < 0)
-        {
-            printf("ERROR: Virtual address %d is invalid! Only virtual addresses 0 to 63 are allowed\n", v_addr);
-        }
-        else if (inst_type == 1)
-        {
-            map(pid, v_addr, input);
-        }
-        else if (inst_type == 2)
-        {
-            store(pid, v_addr, input);
-        }
-        else if (inst_type == 3)
-        {
-            load(pid, v_addr);
-        }
+    wb_close();
+    if (checkpoint_file != NULL)
+    {
+        checkpoint_save(checkpoint_file);
     }
+    stats_report();
+    log_close();
 
     /*logMem();
-    for (int i = 0; i < MAX_PROC; i++)
+    for (int i = 0; i < max_proc; i++)
     {
         printf("%d\n", pid_array[i]);
     }